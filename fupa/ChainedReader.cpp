@@ -9,15 +9,26 @@ ChainedReader::ChainedReader(std::unique_ptr<IDecompressedFileReader> baseReader
 
 void ChainedReader::PushFile(std::unique_ptr<IDecompressedFileReader> reader, bool skipHeader)
 {
-    size_t size = reader->GetFileSize();
-    if (skipHeader)
+    // Nothing is read from the file until it becomes the current file, so readers that
+    // decompress on the fly don't tie up any buffers while they wait their turn
+    std::string name = reader->GetFileName();
+    size_t fileSize = reader->GetFileSize();
+    size_t headerBytes = skipHeader ? sizeof(OuterHeader) : 0;
+
+    m_logger->trace("Pushing file {} with size 0x{:x}", name, fileSize - headerBytes);
+    m_files.emplace_back(std::move(reader), name, nullptr, fileSize, fileSize - headerBytes, headerBytes);
+}
+
+void ChainedReader::PushDeferredFile(const std::string& name, size_t fileSize, tFileOpenerFunc opener, bool skipHeader)
+{
+    size_t headerBytes = skipHeader ? sizeof(OuterHeader) : 0;
+    if (fileSize < headerBytes)
     {
-        reader->ReadData(nullptr, 0, sizeof(OuterHeader));
-        size -= sizeof(OuterHeader);
+        throw std::runtime_error(fmt::format("Size of {} (0x{:x}) is too small to hold a header", name, fileSize));
     }
 
-    m_logger->trace("Pushing file {} with size 0x{:x}", reader->GetFileName(), size);
-    m_files.emplace_back(std::move(reader), size);
+    m_logger->trace("Pushing deferred file {} with size 0x{:x}", name, fileSize - headerBytes);
+    m_files.emplace_back(nullptr, name, std::move(opener), fileSize, fileSize - headerBytes, headerBytes);
 }
 
 void ChainedReader::GotoNextFile()
@@ -30,35 +41,83 @@ void ChainedReader::GotoNextFile()
     m_currentFile++;
 }
 
+void ChainedReader::FinishCurrentFile()
+{
+    // Everything has been read from the current file, so it can give up whatever it was holding
+    FileDescriptor& f = m_files[m_currentFile];
+    m_logger->trace("Finished reading {}", f.Name);
+    if (f.File)
+    {
+        f.File->Close();
+    }
+}
+
+IDecompressedFileReader& ChainedReader::OpenFile(FileDescriptor& f)
+{
+    if (!f.File)
+    {
+        m_logger->debug("Opening {}", f.Name);
+        f.File = f.Opener();
+        if (f.File->GetFileSize() != f.FileSize)
+        {
+            throw std::runtime_error(fmt::format("Size of {} (0x{:x}) does not match the size it was linked with (0x{:x})", f.Name, f.File->GetFileSize(), f.FileSize));
+        }
+    }
+
+    return *f.File;
+}
+
 void ChainedReader::ReadData(char* buffer, size_t bytesToRead, size_t skipBytes)
 {
     size_t bytesSkipped = 0;
     while (bytesSkipped != skipBytes)
     {
-        FileDescriptor& f = m_files[m_currentFile];
-        if (f.BytesRemaining == 0)
+        if (m_files[m_currentFile].BytesRemaining == 0)
         {
             GotoNextFile();
         }
+
+        FileDescriptor& f = m_files[m_currentFile];
         size_t skipFromCurrent = std::min(f.BytesRemaining, skipBytes - bytesSkipped);
-        f.File->ReadData(nullptr, 0, skipFromCurrent);
+
+        // Nothing more is ever read from a file once it has been skipped to the end, so the reader doesn't
+        // have to do the skip itself (which for a compressed file means decompressing everything skipped).
+        // If it hasn't been opened yet, it never needs to be.
+        if (skipFromCurrent != f.BytesRemaining)
+        {
+            OpenFile(f).ReadData(nullptr, 0, f.HeaderBytes + skipFromCurrent);
+            f.HeaderBytes = 0;
+        }
+
         f.BytesRemaining -= skipFromCurrent;
         bytesSkipped += skipFromCurrent;
-        m_logger->trace("Skipped 0x{:x} bytes from {}, now at 0x{:x}", skipFromCurrent, f.File->GetFileName(), (f.File->GetFileSize() - f.BytesRemaining));
+        m_logger->trace("Skipped 0x{:x} bytes from {}, now at 0x{:x}", skipFromCurrent, f.Name, (f.FileSize - f.BytesRemaining));
+
+        if (f.BytesRemaining == 0)
+        {
+            FinishCurrentFile();
+        }
     }
 
     size_t bytesRead = 0;
     while (bytesRead != bytesToRead)
     {
-        FileDescriptor& f = m_files[m_currentFile];
-        if (f.BytesRemaining == 0)
+        if (m_files[m_currentFile].BytesRemaining == 0)
         {
             GotoNextFile();
         }
+
+        FileDescriptor& f = m_files[m_currentFile];
         size_t readFromCurrent = std::min(f.BytesRemaining, bytesToRead - bytesRead);
-        f.File->ReadData(buffer + bytesRead, readFromCurrent);
+        OpenFile(f).ReadData(buffer + bytesRead, readFromCurrent, f.HeaderBytes);
+        f.HeaderBytes = 0;
         f.BytesRemaining -= readFromCurrent;
         bytesRead += readFromCurrent;
-        m_logger->trace("Read 0x{:x} bytes from {}, now at 0x{:x}", readFromCurrent, f.File->GetFileName(), (f.File->GetFileSize() - f.BytesRemaining));
+        m_logger->trace("Read 0x{:x} bytes from {}, now at 0x{:x}", readFromCurrent, f.Name, (f.FileSize - f.BytesRemaining));
+
+        if (f.BytesRemaining == 0)
+        {
+            FinishCurrentFile();
+        }
     }
 }
@@ -2,28 +2,43 @@
 
 #include "pch.h"
 
+typedef std::function<std::unique_ptr<IDecompressedFileReader>()> tFileOpenerFunc;
+
 class ChainedReader
 {
 public:
     ChainedReader(std::unique_ptr<IDecompressedFileReader> baseReader);
     void PushFile(std::unique_ptr<IDecompressedFileReader> reader, bool skipHeader);
+    void PushDeferredFile(const std::string& name, size_t fileSize, tFileOpenerFunc opener, bool skipHeader); // The file is only opened once something is read from it
     void GotoNextFile();
     void ReadData(char* buffer, size_t bytesToRead, size_t skipBytes = 0);
 
 private:
+    void FinishCurrentFile();
+
     struct FileDescriptor
     {
         std::unique_ptr<IDecompressedFileReader> File;
+        std::string Name;
+        tFileOpenerFunc Opener; // Opens File if it hasn't been opened yet
+        size_t FileSize;
         size_t BytesRemaining;
+        size_t HeaderBytes; // Skipped once the file becomes the current file
 
-        FileDescriptor(std::unique_ptr<IDecompressedFileReader> file, size_t bytesRemaining) :
+        FileDescriptor(std::unique_ptr<IDecompressedFileReader> file, const std::string& name, tFileOpenerFunc opener, size_t fileSize, size_t bytesRemaining, size_t headerBytes) :
             File(std::move(file)),
-            BytesRemaining(bytesRemaining)
+            Name(name),
+            Opener(std::move(opener)),
+            FileSize(fileSize),
+            BytesRemaining(bytesRemaining),
+            HeaderBytes(headerBytes)
         {
 
         }
     };
 
+    IDecompressedFileReader& OpenFile(FileDescriptor& f);
+
     std::vector<FileDescriptor> m_files;
     size_t m_currentFile;
     std::shared_ptr<spdlog::logger> m_logger;
@@ -3,59 +3,137 @@
 const size_t kCompressedBufferSize = 0x1000000;
 const size_t kDecompressedBufferSize = 0x400000;
 const size_t kChunkSize = 512 * 1024;
+const uint32_t kCheckpointMagic = 0x504B4352; // RCKP
+const uint32_t kCheckpointVersion = 1;
 
-CompressedFileReader::CompressedFileReader(std::string filename) :
+// Checkpoint sidecar layout: CheckpointFileHeader, then the decompressed window for each
+// checkpoint, then an array of Checkpoints and finally the number of checkpoints as a uint64_t.
+struct CheckpointFileHeader
+{
+    uint32_t Magic;
+    uint32_t Version;
+    OuterHeader PakHeader;
+};
+
+ScratchBufferPool& CompressedFileReader::GetBufferPool()
+{
+    // Readers only hold a buffer while they are being read from, so keeping one idle buffer per
+    // core covers extracting a pak on every core without pinning memory for every linked pak
+    static ScratchBufferPool pool(kCompressedBufferSize + kDecompressedBufferSize, std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+std::string CompressedFileReader::GetCheckpointPath(const std::string& filename)
+{
+    return filename + ".ckpt";
+}
+
+CompressedFileReader::CompressedFileReader(std::string filename, bool asyncPrefetch, bool useCheckpoints) :
     m_filename(filename),
     m_file(filename, std::ios::in | std::ios::binary),
     m_scratchData(nullptr),
     m_tempCompressedData(nullptr),
-    m_tempDecompressedData(nullptr)
+    m_tempDecompressedData(nullptr),
+    m_closed(false),
+    m_asyncPrefetch(asyncPrefetch),
+    m_stopPrefetch(false),
+    m_checkpointInterval(0),
+    m_nextCheckpoint(0)
 {
     if (!m_file.is_open())
     {
         throw std::runtime_error("Failed to open file");
     }
 
-    m_scratchData = reinterpret_cast<char*>(_aligned_malloc(kCompressedBufferSize + kDecompressedBufferSize, 0x1000));
-    m_tempCompressedData = m_scratchData;
-    m_tempDecompressedData = m_scratchData + kCompressedBufferSize;
-
-    OuterHeader header;
-    m_file.read(reinterpret_cast<char*>(&header), sizeof(OuterHeader));
+    m_file.read(reinterpret_cast<char*>(&m_header), sizeof(OuterHeader));
     m_file.seekg(0, std::ios::beg);
+    if (m_file.fail())
+    {
+        throw std::runtime_error(fmt::format("Failed to read header of {}", m_filename));
+    }
 
-    m_compressedSize = header.CompressedSize;
-    m_decompressedSize = header.DecompressedSize;
+    m_compressedSize = m_header.CompressedSize;
+    m_decompressedSize = m_header.DecompressedSize;
     m_totalDecompressed = sizeof(OuterHeader);
     m_bytesRead = 0;
     m_bytesInDecompressedBuffer = 0;
     m_bytesProcessed = 0;
 
+    if (useCheckpoints)
+    {
+        LoadCheckpoints();
+    }
+}
+
+CompressedFileReader::~CompressedFileReader()
+{
+    Close();
+}
+
+void CompressedFileReader::Activate()
+{
+    // The scratch buffers are only taken from the pool once the file is actually read from,
+    // which for linked paks is long after the reader is created
+    if (m_closed)
+    {
+        throw std::runtime_error(fmt::format("Attempted to read from {} after it was closed", m_filename));
+    }
+
+    m_scratchData = GetBufferPool().Acquire();
+    m_tempCompressedData = m_scratchData;
+    m_tempDecompressedData = m_scratchData + kCompressedBufferSize;
+
+    OuterHeader& header = m_header;
     size_t dataToRead = std::min(kCompressedBufferSize, m_compressedSize);
     m_file.read(m_tempCompressedData, dataToRead);
     m_bytesRead += dataToRead;
+    m_readLimit = m_bytesRead;
 
-    uint64_t expectedDecompressedSize = rtech::SetupDecompressState(m_decompressionState, m_tempCompressedData, 0xFFFFFF, m_compressedSize, 0, sizeof(OuterHeader));
+    uint64_t expectedDecompressedSize = rtech::SetupDecompressState(&m_decompressionState, m_tempCompressedData, 0xFFFFFF, m_compressedSize, 0, sizeof(OuterHeader));
     if (expectedDecompressedSize != m_decompressedSize)
     {
         throw std::runtime_error(fmt::format("Decompressed size in header (0x{:x}) does not match decompressed size from data (0x{:x})", m_decompressedSize, expectedDecompressedSize));
     }
 
-    m_decompressionState[1] = reinterpret_cast<uint64_t>(m_tempDecompressedData);
-    m_decompressionState[3] = kDecompressedBufferSize - 1;
+    m_decompressionState.OutputBuffer = reinterpret_cast<uint64_t>(m_tempDecompressedData);
+    m_decompressionState.OutputMask = kDecompressedBufferSize - 1;
     memcpy(m_tempDecompressedData, reinterpret_cast<char*>(&header), sizeof(OuterHeader));
     DecompressNext();
+
+    // From here on the prefetch thread refills chunks as the decompressor releases them
+    StartPrefetch();
 }
 
-CompressedFileReader::~CompressedFileReader()
+void CompressedFileReader::Close()
 {
+    StopPrefetch();
+    m_closed = true;
+
+    // Don't leave a partial sidecar or cache file behind if the file wasn't read to the end
+    if (m_checkpointOutput.is_open())
+    {
+        m_checkpointOutput.close();
+        std::error_code ec;
+        std::filesystem::remove(GetCheckpointPath(m_filename) + ".tmp", ec);
+    }
+
+    if (m_cacheOutput.is_open())
+    {
+        m_cacheOutput.close();
+        std::error_code ec;
+        std::filesystem::remove(m_cacheTempPath, ec);
+    }
+
     if (m_scratchData != nullptr)
     {
-        _aligned_free(m_scratchData);
+        GetBufferPool().Release(m_scratchData);
         m_scratchData = nullptr;
         m_tempCompressedData = nullptr;
         m_tempDecompressedData = nullptr;
     }
+
+    m_checkpointFile.close();
+    m_file.close();
 }
 
 std::string CompressedFileReader::GetFileName()
@@ -65,12 +143,43 @@ std::string CompressedFileReader::GetFileName()
 
 void CompressedFileReader::ReadData(char* buffer, size_t bytesToRead, size_t skipBytes)
 {
+    if (bytesToRead == 0 && skipBytes == 0)
+    {
+        return;
+    }
+
+    if (m_scratchData == nullptr)
+    {
+        Activate();
+    }
+
     uint64_t bytesCopied = 0;
     uint64_t bytesSkipped = 0;
     while (bytesSkipped != skipBytes || bytesCopied != bytesToRead)
     {
+        // Jump ahead instead of decompressing everything being skipped if there's a checkpoint to use
+        if (bytesSkipped != skipBytes)
+        {
+            const Checkpoint* checkpoint = FindCheckpoint(m_bytesProcessed + (skipBytes - bytesSkipped));
+            if (checkpoint != nullptr)
+            {
+                bytesSkipped += checkpoint->BlockStart - m_bytesProcessed;
+                RestoreCheckpoint(*checkpoint);
+                continue;
+            }
+        }
+
         if (m_bytesProcessed == m_totalDecompressed)
         {
+            uint64_t directBytes = bytesSkipped == skipBytes ? GetDirectReadSize(bytesCopied, bytesToRead - bytesCopied) : 0;
+            if (directBytes > 0)
+            {
+                DecompressDirect(buffer + bytesCopied, directBytes);
+                bytesCopied += directBytes;
+                m_bytesProcessed += directBytes;
+                continue;
+            }
+
             DecompressNext();
         }
 
@@ -109,24 +218,497 @@ void CompressedFileReader::DecompressNext()
         throw std::runtime_error("Cannot decompress next block, already decompressed whole file");
     }
 
-    uint64_t totalDecompressedBefore = m_decompressionState[10] == sizeof(OuterHeader) ? 0 : m_decompressionState[10];
-    uint64_t inputChunksProcessedBefore = m_decompressionState[9] / kChunkSize;
-    rtech::DoDecompress(m_decompressionState, m_bytesRead, m_totalDecompressed + 0x400000);
-    uint64_t totalDecompressedAfter = m_decompressionState[10];
-    uint64_t inputChunksProcessedAfter = m_decompressionState[9] / kChunkSize;
+    uint64_t totalDecompressedBefore = m_decompressionState.OutputPosition == sizeof(OuterHeader) ? 0 : m_decompressionState.OutputPosition;
+    uint64_t windowEnd = std::min(totalDecompressedBefore + kDecompressedBufferSize, static_cast<uint64_t>(m_decompressedSize));
+    RunDecompressor(m_totalDecompressed + kDecompressedBufferSize, windowEnd);
+    uint64_t totalDecompressedAfter = m_decompressionState.OutputPosition;
+    if (totalDecompressedAfter == m_totalDecompressed)
+    {
+        throw std::runtime_error(fmt::format("Decompression of {} stalled at 0x{:x}", m_filename, m_totalDecompressed));
+    }
+
+    m_bytesInDecompressedBuffer = totalDecompressedAfter - totalDecompressedBefore;
+    m_totalDecompressed = m_decompressionState.OutputPosition;
+
+    if (m_checkpointOutput.is_open())
+    {
+        WriteCheckpoint(totalDecompressedBefore, m_tempDecompressedData);
+    }
+
+    if (m_cacheOutput.is_open())
+    {
+        WriteToCache(m_tempDecompressedData, m_bytesInDecompressedBuffer);
+    }
+}
+
+void CompressedFileReader::CacheDecompressedData(const std::string& path)
+{
+    if (m_bytesProcessed != 0)
+    {
+        throw std::runtime_error("Caching must be enabled before any data is read");
+    }
 
-    uint64_t chunksProcessed = inputChunksProcessedAfter - inputChunksProcessedBefore;
-    for (uint64_t i = 0; i < chunksProcessed; i++)
+    // Several fupa processes may be populating the same cache entry, so each writes to its own temporary file
+    m_cachePath = path;
+    m_cacheTempPath = fmt::format("{}.{}.{:x}.tmp", path, GetCurrentProcessId(), reinterpret_cast<uintptr_t>(this));
+    m_cacheOutput.open(m_cacheTempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_cacheOutput.is_open())
     {
-        size_t dataToRead = std::min(kChunkSize, m_compressedSize - m_bytesRead);
-        if (dataToRead == 0)
+        throw std::runtime_error(fmt::format("Failed to open cache file {}", m_cacheTempPath));
+    }
+
+    // The first window is written when it gets decompressed, unless that has already happened
+    if (m_scratchData != nullptr)
+    {
+        WriteToCache(m_tempDecompressedData, m_bytesInDecompressedBuffer);
+    }
+}
+
+void CompressedFileReader::WriteToCache(const char* data, uint64_t size)
+{
+    m_cacheOutput.write(data, size);
+    if (m_cacheOutput.fail())
+    {
+        spdlog::get("logger")->warn("Failed to write to cache file {}, no longer caching {}", m_cacheTempPath, m_filename);
+        m_cacheOutput.close();
+        std::error_code ec;
+        std::filesystem::remove(m_cacheTempPath, ec);
+        return;
+    }
+
+    if (m_totalDecompressed == m_decompressedSize)
+    {
+        m_cacheOutput.close();
+        std::error_code ec;
+        std::filesystem::rename(m_cacheTempPath, m_cachePath, ec);
+        if (ec)
+        {
+            spdlog::get("logger")->warn("Failed to move {} into the cache: {}", m_cacheTempPath, ec.message());
+            std::filesystem::remove(m_cacheTempPath, ec);
+            return;
+        }
+
+        spdlog::get("logger")->debug("Cached decompressed copy of {} in {}", m_filename, m_cachePath);
+    }
+}
+
+uint64_t CompressedFileReader::GetDirectReadSize(uint64_t bytesAlreadyCopied, uint64_t bytesRemaining)
+{
+    // Matches can reference up to a full window behind the current position. Decompressing straight
+    // into the caller's buffer is only safe once that much history is already sitting in front of it,
+    // and only from a window boundary, since the decompressor always works a window at a time.
+    if (bytesAlreadyCopied < kDecompressedBufferSize || (m_totalDecompressed % kDecompressedBufferSize) != 0)
+    {
+        return 0;
+    }
+
+    uint64_t bytesLeftInFile = m_decompressedSize - m_totalDecompressed;
+    if (bytesRemaining >= bytesLeftInFile)
+    {
+        return bytesLeftInFile;
+    }
+
+    return bytesRemaining - (bytesRemaining % kDecompressedBufferSize);
+}
+
+void CompressedFileReader::DecompressDirect(char* buffer, uint64_t bytesToDecompress)
+{
+    uint64_t start = m_totalDecompressed;
+    uint64_t end = start + bytesToDecompress;
+
+    // Point the output at the caller's buffer with no wrapping, so the decompressor writes to
+    // buffer[position - start] and copies matches from the data already in front of it
+    m_decompressionState.OutputBuffer = reinterpret_cast<uint64_t>(buffer) - start;
+    m_decompressionState.OutputMask = ~0ULL;
+
+    while (m_decompressionState.OutputPosition < end)
+    {
+        uint64_t positionBefore = m_decompressionState.OutputPosition;
+        uint64_t windowEnd = std::min(end, positionBefore + kDecompressedBufferSize);
+        RunDecompressor(windowEnd, windowEnd);
+
+        if (m_decompressionState.OutputPosition == positionBefore)
         {
-            break;
+            throw std::runtime_error(fmt::format("Decompression of {} stalled at 0x{:x}", m_filename, positionBefore));
         }
+
+        // Windows land in the caller's buffer here, but they are the same windows DecompressNext would produce
+        if (m_checkpointOutput.is_open())
+        {
+            WriteCheckpoint(positionBefore, buffer + (positionBefore - start));
+        }
+    }
+
+    if (m_decompressionState.OutputPosition != end)
+    {
+        throw std::runtime_error(fmt::format("Decompressed past end of direct read in {} (0x{:x} > 0x{:x})", m_filename, m_decompressionState.OutputPosition, end));
+    }
+
+    // Switch back to the staging window. The last window of output becomes the history that
+    // subsequent matches reference, and it lines up with the start of the window since end is aligned.
+    if (end < m_decompressedSize)
+    {
+        memcpy(m_tempDecompressedData, buffer + bytesToDecompress - kDecompressedBufferSize, kDecompressedBufferSize);
+    }
+
+    m_decompressionState.OutputBuffer = reinterpret_cast<uint64_t>(m_tempDecompressedData);
+    m_decompressionState.OutputMask = kDecompressedBufferSize - 1;
+    m_bytesInDecompressedBuffer = 0;
+    m_totalDecompressed = end;
+
+    if (m_cacheOutput.is_open())
+    {
+        WriteToCache(buffer, bytesToDecompress);
+    }
+}
+
+void CompressedFileReader::RunDecompressor(uint64_t outputLimit, uint64_t outputEnd)
+{
+    // Hand the decompressor whatever has been read so far. It stops early when it runs out of input, and only
+    // then is it worth waiting on the prefetch thread - for what the decompressor asked for, and at least a
+    // chunk past where it got to, so the reads stay ahead of it.
+    uint64_t bytesNeeded = 0;
+    while (m_decompressionState.OutputPosition < outputEnd)
+    {
+        uint64_t positionBefore = m_decompressionState.OutputPosition;
+        uint64_t bytesAvailable = WaitForCompressedData(bytesNeeded);
+        rtech::DoDecompress(&m_decompressionState, bytesAvailable, outputLimit);
+
+        // Chunks that the decompressor has moved past can be refilled with the next part of the file
+        ReleaseCompressedChunks(m_decompressionState.InputPosition / kChunkSize);
+
+        if (m_decompressionState.OutputPosition != positionBefore)
+        {
+            bytesNeeded = 0;
+            continue;
+        }
+
+        // No progress even with all the input it could be given, so leave it to the caller to decide what that means
+        if (bytesNeeded != 0)
+        {
+            return;
+        }
+
+        bytesNeeded = std::max(m_decompressionState.InputBytesNeeded, m_decompressionState.InputPosition + kChunkSize);
+    }
+}
+
+uint64_t CompressedFileReader::WaitForCompressedData(uint64_t bytesNeeded)
+{
+    if (!m_asyncPrefetch)
+    {
+        return m_bytesRead;
+    }
+
+    // Nothing past the read limit can be read until the decompressor releases more chunks, so that's as
+    // far as it's worth waiting for
+    std::unique_lock<std::mutex> lock(m_prefetchMutex);
+    uint64_t target = std::min(bytesNeeded, m_readLimit);
+    m_prefetchCondition.wait(lock, [this, target] { return m_prefetchError || m_bytesRead >= target; });
+    if (m_prefetchError)
+    {
+        std::rethrow_exception(m_prefetchError);
+    }
+
+    return m_bytesRead;
+}
+
+void CompressedFileReader::ReleaseCompressedChunks(uint64_t chunksConsumed)
+{
+    uint64_t readLimit = std::min(m_compressedSize, chunksConsumed * kChunkSize + kCompressedBufferSize);
+
+    if (m_asyncPrefetch)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_prefetchMutex);
+            m_readLimit = readLimit;
+        }
+        m_prefetchCondition.notify_all();
+        return;
+    }
+
+    ReadCompressedChunks(readLimit);
+}
+
+void CompressedFileReader::ReadCompressedChunks(uint64_t readLimit)
+{
+    while (m_bytesRead < readLimit)
+    {
+        size_t dataToRead = std::min(kChunkSize, readLimit - m_bytesRead);
         m_file.read(m_tempCompressedData + (m_bytesRead % kCompressedBufferSize), dataToRead);
         m_bytesRead += dataToRead;
     }
+}
 
-    m_bytesInDecompressedBuffer = totalDecompressedAfter - totalDecompressedBefore;
-    m_totalDecompressed = m_decompressionState[10];
+void CompressedFileReader::StartPrefetch()
+{
+    if (m_asyncPrefetch)
+    {
+        m_stopPrefetch = false;
+        m_prefetchThread = std::thread(&CompressedFileReader::PrefetchThread, this);
+    }
+}
+
+void CompressedFileReader::StopPrefetch()
+{
+    if (!m_prefetchThread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchMutex);
+        m_stopPrefetch = true;
+    }
+    m_prefetchCondition.notify_all();
+    m_prefetchThread.join();
+}
+
+void CompressedFileReader::PrefetchThread()
+{
+    std::unique_lock<std::mutex> lock(m_prefetchMutex);
+    while (true)
+    {
+        m_prefetchCondition.wait(lock, [this] { return m_stopPrefetch || m_bytesRead < m_readLimit; });
+        if (m_stopPrefetch)
+        {
+            return;
+        }
+
+        // The region between m_bytesRead and m_readLimit has already been consumed by the
+        // decompressor, so it can be filled without holding the lock
+        uint64_t readPosition = m_bytesRead;
+        size_t dataToRead = std::min(kChunkSize, m_readLimit - readPosition);
+        lock.unlock();
+        m_file.read(m_tempCompressedData + (readPosition % kCompressedBufferSize), dataToRead);
+        bool failed = m_file.fail();
+        lock.lock();
+
+        if (failed)
+        {
+            m_prefetchError = std::make_exception_ptr(std::runtime_error(fmt::format("Failed to read compressed data from {}", m_filename)));
+            m_prefetchCondition.notify_all();
+            return;
+        }
+
+        m_bytesRead += dataToRead;
+        m_prefetchCondition.notify_all();
+    }
+}
+
+void CompressedFileReader::RecordCheckpoints(uint64_t interval)
+{
+    if (interval < kDecompressedBufferSize)
+    {
+        throw std::runtime_error(fmt::format("Checkpoint interval must be at least 0x{:x} bytes", kDecompressedBufferSize));
+    }
+
+    std::string path = GetCheckpointPath(m_filename) + ".tmp";
+    m_checkpointOutput.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_checkpointOutput.is_open())
+    {
+        throw std::runtime_error(fmt::format("Failed to open checkpoint file {}", path));
+    }
+
+    CheckpointFileHeader fileHeader;
+    fileHeader.Magic = kCheckpointMagic;
+    fileHeader.Version = kCheckpointVersion;
+    fileHeader.PakHeader = m_header;
+    m_checkpointOutput.write(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+
+    m_checkpointInterval = interval;
+    m_nextCheckpoint = m_totalDecompressed + interval;
+    m_checkpoints.clear();
+}
+
+void CompressedFileReader::WriteCheckpoint(uint64_t blockStart, const char* window)
+{
+    // A checkpoint is the decompressor state straight after a window has been filled, along with
+    // the window itself, which is all the history the following window can reference
+    uint64_t blockEnd = m_decompressionState.OutputPosition;
+    if (blockEnd >= m_nextCheckpoint && blockEnd < m_decompressedSize)
+    {
+        Checkpoint checkpoint;
+        checkpoint.BlockStart = blockStart;
+        checkpoint.BlockEnd = blockEnd;
+        checkpoint.WindowOffset = m_checkpointOutput.tellp();
+        checkpoint.State = m_decompressionState;
+        m_checkpointOutput.write(window, blockEnd - blockStart);
+        m_checkpoints.push_back(checkpoint);
+        m_nextCheckpoint = blockEnd + m_checkpointInterval;
+    }
+
+    if (blockEnd != m_decompressedSize)
+    {
+        return;
+    }
+
+    // Whole file has been decompressed, so write out the checkpoint table and move the sidecar into place
+    uint64_t numCheckpoints = m_checkpoints.size();
+    m_checkpointOutput.write(reinterpret_cast<char*>(m_checkpoints.data()), sizeof(Checkpoint) * numCheckpoints);
+    m_checkpointOutput.write(reinterpret_cast<char*>(&numCheckpoints), sizeof(numCheckpoints));
+    m_checkpointOutput.close();
+    if (m_checkpointOutput.fail())
+    {
+        throw std::runtime_error(fmt::format("Failed to write checkpoints for {}", m_filename));
+    }
+
+    std::string path = GetCheckpointPath(m_filename);
+    std::filesystem::rename(path + ".tmp", path);
+    spdlog::get("logger")->info("Wrote {} checkpoints to {}", numCheckpoints, path);
+    m_checkpoints.clear();
+}
+
+void CompressedFileReader::LoadCheckpoints()
+{
+    auto logger = spdlog::get("logger");
+    std::string path = GetCheckpointPath(m_filename);
+    m_checkpointFile.open(path, std::ios::in | std::ios::binary);
+    if (!m_checkpointFile.is_open())
+    {
+        logger->debug("No checkpoints found for {}", m_filename);
+        return;
+    }
+
+    // Only use the checkpoints if they were recorded from exactly this file
+    CheckpointFileHeader fileHeader;
+    m_checkpointFile.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+    if (m_checkpointFile.fail() || fileHeader.Magic != kCheckpointMagic || fileHeader.Version != kCheckpointVersion || memcmp(&fileHeader.PakHeader, &m_header, sizeof(OuterHeader)) != 0)
+    {
+        logger->warn("Ignoring checkpoints in {} - they do not match {}", path, m_filename);
+        m_checkpointFile.close();
+        return;
+    }
+
+    // The count is at the very end of the file, with the table in front of it
+    m_checkpointFile.seekg(0, std::ios::end);
+    uint64_t fileSize = m_checkpointFile.tellg();
+    uint64_t numCheckpoints = 0;
+    if (fileSize >= sizeof(fileHeader) + sizeof(numCheckpoints))
+    {
+        m_checkpointFile.seekg(fileSize - sizeof(numCheckpoints));
+        m_checkpointFile.read(reinterpret_cast<char*>(&numCheckpoints), sizeof(numCheckpoints));
+    }
+
+    uint64_t maxCheckpoints = fileSize >= sizeof(fileHeader) + sizeof(numCheckpoints) ? (fileSize - sizeof(fileHeader) - sizeof(numCheckpoints)) / sizeof(Checkpoint) : 0;
+    if (m_checkpointFile.fail() || fileSize < sizeof(fileHeader) + sizeof(numCheckpoints) || numCheckpoints > maxCheckpoints)
+    {
+        logger->warn("Ignoring checkpoints in {} - checkpoint count does not fit in the file", path);
+        m_checkpointFile.close();
+        return;
+    }
+
+    uint64_t tableOffset = fileSize - sizeof(numCheckpoints) - sizeof(Checkpoint) * numCheckpoints;
+    m_checkpointFile.seekg(tableOffset);
+    m_checkpoints.resize(numCheckpoints);
+    m_checkpointFile.read(reinterpret_cast<char*>(m_checkpoints.data()), sizeof(Checkpoint) * numCheckpoints);
+    if (m_checkpointFile.fail())
+    {
+        logger->warn("Ignoring checkpoints in {} - failed to read checkpoint table", path);
+        m_checkpoints.clear();
+        m_checkpointFile.close();
+        return;
+    }
+
+    if (!ValidateCheckpoints(tableOffset))
+    {
+        logger->warn("Ignoring checkpoints in {} - checkpoint table is corrupt", path);
+        m_checkpoints.clear();
+        m_checkpointFile.close();
+        return;
+    }
+
+    logger->debug("Loaded {} checkpoints for {}", numCheckpoints, m_filename);
+}
+
+bool CompressedFileReader::ValidateCheckpoints(uint64_t tableOffset)
+{
+    // Checkpoints have to be in order, each a single window somewhere in the file, with the window
+    // saved between the header and the table. Anything else would send the decompressor off into the weeds.
+    uint64_t previousEnd = 0;
+    for (const Checkpoint& checkpoint : m_checkpoints)
+    {
+        uint64_t windowSize = checkpoint.BlockEnd - checkpoint.BlockStart;
+        if (checkpoint.BlockStart < previousEnd || checkpoint.BlockEnd <= checkpoint.BlockStart || checkpoint.BlockEnd >= m_decompressedSize || windowSize > kDecompressedBufferSize)
+        {
+            return false;
+        }
+
+        if (checkpoint.WindowOffset < sizeof(CheckpointFileHeader) || checkpoint.WindowOffset > tableOffset || windowSize > tableOffset - checkpoint.WindowOffset)
+        {
+            return false;
+        }
+
+        if (checkpoint.State.OutputPosition != checkpoint.BlockEnd || checkpoint.State.InputPosition > m_compressedSize)
+        {
+            return false;
+        }
+
+        previousEnd = checkpoint.BlockEnd;
+    }
+
+    return true;
+}
+
+const CompressedFileReader::Checkpoint* CompressedFileReader::FindCheckpoint(uint64_t position)
+{
+    // Checkpoint recording and caching both need every byte of the file to go through the decompressor
+    if (m_checkpoints.empty() || m_checkpointOutput.is_open() || m_cacheOutput.is_open())
+    {
+        return nullptr;
+    }
+
+    // Find the last checkpoint whose window starts at or before the position
+    auto it = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), position, [](uint64_t pos, const Checkpoint& checkpoint) {
+        return pos < checkpoint.BlockStart;
+    });
+    if (it == m_checkpoints.begin())
+    {
+        return nullptr;
+    }
+    --it;
+
+    // Only worth jumping if it gets past everything that has already been decompressed
+    if (it->BlockStart <= m_totalDecompressed)
+    {
+        return nullptr;
+    }
+
+    return &*it;
+}
+
+void CompressedFileReader::RestoreCheckpoint(const Checkpoint& checkpoint)
+{
+    spdlog::get("logger")->trace("Jumping to checkpoint at 0x{:x} in {}", checkpoint.BlockStart, m_filename);
+
+    // The prefetch thread fills the ring buffer from the current file position, so it has to
+    // be stopped while both are moved
+    StopPrefetch();
+
+    uint64_t windowSize = checkpoint.BlockEnd - checkpoint.BlockStart;
+    m_checkpointFile.seekg(checkpoint.WindowOffset);
+    m_checkpointFile.read(m_tempDecompressedData, windowSize);
+    if (m_checkpointFile.fail())
+    {
+        throw std::runtime_error(fmt::format("Failed to read checkpoint window for {}", m_filename));
+    }
+
+    m_decompressionState = checkpoint.State;
+    m_decompressionState.InputBuffer = reinterpret_cast<uint64_t>(m_tempCompressedData);
+    m_decompressionState.OutputBuffer = reinterpret_cast<uint64_t>(m_tempDecompressedData);
+    m_decompressionState.OutputMask = kDecompressedBufferSize - 1;
+
+    // Refill the compressed ring buffer with exactly what it held after this window was decompressed
+    uint64_t chunksConsumed = m_decompressionState.InputPosition / kChunkSize;
+    m_bytesRead = chunksConsumed * kChunkSize;
+    m_file.clear();
+    m_file.seekg(m_bytesRead);
+    ReadCompressedChunks(std::min(m_compressedSize, m_bytesRead + kCompressedBufferSize));
+    m_readLimit = m_bytesRead;
+
+    m_bytesInDecompressedBuffer = windowSize;
+    m_totalDecompressed = checkpoint.BlockEnd;
+    m_bytesProcessed = checkpoint.BlockStart;
+
+    StartPrefetch();
 }
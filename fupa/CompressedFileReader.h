@@ -3,25 +3,86 @@
 class CompressedFileReader : public IDecompressedFileReader
 {
 public:
-    CompressedFileReader(std::string filename);
+    CompressedFileReader(std::string filename, bool asyncPrefetch = false, bool useCheckpoints = false);
     ~CompressedFileReader() override;
     std::string GetFileName() override;
     void ReadData(char* buffer, size_t bytesToRead, size_t skipBytes) override;
     size_t GetFileSize() override;
+    void Close() override;
+
+    // Writes a checkpoint sidecar roughly every interval bytes of output. The sidecar is
+    // only kept if the file is then read through to the end.
+    void RecordCheckpoints(uint64_t interval);
+
+    // Writes everything that is decompressed to path, which is only created once the whole
+    // file has been decompressed. Must be called before any data is read.
+    void CacheDecompressedData(const std::string& path);
+    static std::string GetCheckpointPath(const std::string& filename);
+    static ScratchBufferPool& GetBufferPool();
 
 private:
+    struct Checkpoint
+    {
+        uint64_t BlockStart;
+        uint64_t BlockEnd;
+        uint64_t WindowOffset;
+        rtech::DecompressState State;
+    };
+
+    static_assert(sizeof(Checkpoint) == 0xA0, "Checkpoint must be 0xA0 bytes");
+
+    void Activate();
     void DecompressNext();
+    uint64_t GetDirectReadSize(uint64_t bytesAlreadyCopied, uint64_t bytesRemaining);
+    void DecompressDirect(char* buffer, uint64_t bytesToDecompress);
+    void WriteToCache(const char* data, uint64_t size);
+    void RunDecompressor(uint64_t outputLimit, uint64_t outputEnd);
+    uint64_t WaitForCompressedData(uint64_t bytesNeeded);
+    void ReleaseCompressedChunks(uint64_t chunksConsumed);
+    void ReadCompressedChunks(uint64_t readLimit);
+    void StartPrefetch();
+    void StopPrefetch();
+    void PrefetchThread();
+    void WriteCheckpoint(uint64_t blockStart, const char* window);
+    void LoadCheckpoints();
+    bool ValidateCheckpoints(uint64_t tableOffset);
+    const Checkpoint* FindCheckpoint(uint64_t position);
+    void RestoreCheckpoint(const Checkpoint& checkpoint);
 
     std::string m_filename;
     std::ifstream m_file;
+    OuterHeader m_header;
     size_t m_compressedSize;
     size_t m_decompressedSize;
     char* m_scratchData;
     char* m_tempCompressedData;
     char* m_tempDecompressedData;
-    uint64_t m_decompressionState[17];
+    rtech::DecompressState m_decompressionState;
     uint64_t m_bytesInDecompressedBuffer;
     uint64_t m_totalDecompressed;
     uint64_t m_bytesRead;
     uint64_t m_bytesProcessed;
+    bool m_closed;
+
+    // Asynchronous read-ahead. When enabled, m_bytesRead and m_readLimit are shared with the
+    // prefetch thread and must only be accessed while holding m_prefetchMutex.
+    bool m_asyncPrefetch;
+    std::thread m_prefetchThread;
+    std::mutex m_prefetchMutex;
+    std::condition_variable m_prefetchCondition;
+    uint64_t m_readLimit;
+    bool m_stopPrefetch;
+    std::exception_ptr m_prefetchError;
+
+    // Decoder checkpoints, either loaded from a sidecar file or being recorded into one
+    std::vector<Checkpoint> m_checkpoints;
+    std::ifstream m_checkpointFile;
+    std::ofstream m_checkpointOutput;
+    uint64_t m_checkpointInterval;
+    uint64_t m_nextCheckpoint;
+
+    // Decompressed copy of the file being written to the cache
+    std::ofstream m_cacheOutput;
+    std::string m_cachePath;
+    std::string m_cacheTempPath;
 };
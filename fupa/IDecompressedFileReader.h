@@ -9,4 +9,5 @@ public:
     virtual std::string GetFileName() = 0;
     virtual void ReadData(char* buffer, size_t bytesToRead, size_t skipBytes = 0) = 0; // If read fails, throws exception
     virtual size_t GetFileSize() = 0;
+    virtual void Close() {} // Releases anything held for reading. The reader must not be read from afterwards.
 };
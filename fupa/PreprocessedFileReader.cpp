@@ -21,8 +21,16 @@ std::string PreprocessedFileReader::GetFileName()
 
 void PreprocessedFileReader::ReadData(char* buffer, size_t bytesToRead, size_t skipBytes)
 {
-    m_file.seekg(skipBytes, std::ios::cur);
-    m_file.read(buffer, bytesToRead);
+    if (skipBytes != 0)
+    {
+        m_file.seekg(skipBytes, std::ios::cur);
+    }
+
+    if (bytesToRead != 0)
+    {
+        m_file.read(buffer, bytesToRead);
+    }
+
     if (m_file.fail())
     {
         throw std::runtime_error("File read failed");
@@ -32,3 +40,8 @@ size_t PreprocessedFileReader::GetFileSize()
 {
     return m_size;
 }
+
+void PreprocessedFileReader::Close()
+{
+    m_file.close();
+}
@@ -8,6 +8,7 @@ public:
     std::string GetFileName() override;
     void ReadData(char* buffer, size_t bytesToRead, size_t skipBytes) override;
     size_t GetFileSize() override;
+    void Close() override;
 
 private:
     std::string m_filename;
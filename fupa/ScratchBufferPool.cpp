@@ -0,0 +1,69 @@
+#include "pch.h"
+
+ScratchBufferPool::ScratchBufferPool(size_t bufferSize, size_t maxIdleBuffers) :
+    m_bufferSize(bufferSize),
+    m_maxIdleBuffers(maxIdleBuffers),
+    m_buffersInUse(0),
+    m_peakBuffersInUse(0)
+{
+
+}
+
+ScratchBufferPool::~ScratchBufferPool()
+{
+    for (char* buffer : m_idleBuffers)
+    {
+        _aligned_free(buffer);
+    }
+}
+
+char* ScratchBufferPool::Acquire()
+{
+    char* buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffersInUse++;
+        if (m_buffersInUse > m_peakBuffersInUse)
+        {
+            m_peakBuffersInUse = m_buffersInUse;
+            spdlog::get("logger")->trace("Scratch buffers in use: {} (0x{:x} bytes)", m_buffersInUse, m_buffersInUse * m_bufferSize);
+        }
+
+        if (!m_idleBuffers.empty())
+        {
+            buffer = m_idleBuffers.back();
+            m_idleBuffers.pop_back();
+            return buffer;
+        }
+    }
+
+    buffer = reinterpret_cast<char*>(_aligned_malloc(m_bufferSize, 0x1000));
+    if (buffer == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffersInUse--;
+        throw std::runtime_error(fmt::format("Failed to allocate 0x{:x} byte scratch buffer", m_bufferSize));
+    }
+
+    return buffer;
+}
+
+void ScratchBufferPool::Release(char* buffer)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffersInUse--;
+        if (m_idleBuffers.size() < m_maxIdleBuffers)
+        {
+            m_idleBuffers.push_back(buffer);
+            return;
+        }
+    }
+
+    _aligned_free(buffer);
+}
+
+size_t ScratchBufferPool::GetBufferSize() const
+{
+    return m_bufferSize;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Hands out fixed size, page aligned scratch buffers. Buffers that are given back are kept
+// around (up to a limit) for the next reader to use, so only as many buffers exist as there
+// are readers active at the same time.
+class ScratchBufferPool
+{
+public:
+    ScratchBufferPool(size_t bufferSize, size_t maxIdleBuffers);
+    ~ScratchBufferPool();
+    char* Acquire();
+    void Release(char* buffer);
+    size_t GetBufferSize() const;
+
+private:
+    size_t m_bufferSize;
+    size_t m_maxIdleBuffers;
+    std::mutex m_mutex;
+    std::vector<char*> m_idleBuffers;
+    size_t m_buffersInUse;
+    size_t m_peakBuffersInUse;
+};
@@ -0,0 +1,128 @@
+#include "pch.h"
+
+SlotArena::SlotArena() :
+    m_data(nullptr),
+    m_size(0),
+    m_numaNode(NUMA_NO_PREFERRED_NODE)
+{
+
+}
+
+SlotArena::~SlotArena()
+{
+    Release();
+}
+
+void SlotArena::Reserve(uint64_t size, bool commit, const SlotArenaOptions& options)
+{
+    Release();
+    if (size == 0)
+    {
+        return;
+    }
+
+    auto logger = spdlog::get("logger");
+    m_numaNode = NUMA_NO_PREFERRED_NODE;
+    if (options.NumaLocal)
+    {
+        PROCESSOR_NUMBER processor;
+        GetCurrentProcessorNumberEx(&processor);
+        USHORT node;
+        if (GetNumaProcessorNodeEx(&processor, &node))
+        {
+            m_numaNode = node;
+        }
+    }
+
+    DWORD type = MEM_RESERVE | (commit ? MEM_COMMIT : 0);
+
+    // Large pages can't be committed a bit at a time, so they're only used when everything is committed now
+    if (options.LargePages && commit)
+    {
+        static bool privilegeEnabled = EnableLockMemoryPrivilege();
+        uint64_t largePageSize = GetLargePageMinimum();
+        if (privilegeEnabled && largePageSize != 0)
+        {
+            uint64_t largeSize = (size + largePageSize - 1) & ~(largePageSize - 1);
+            m_data = Allocate(nullptr, largeSize, type | MEM_LARGE_PAGES);
+            if (m_data != nullptr)
+            {
+                m_size = largeSize;
+                logger->debug("Allocated 0x{:x} bytes of slots using large pages", m_size);
+                return;
+            }
+        }
+
+        static std::once_flag warned;
+        std::call_once(warned, [&logger]() {
+            logger->warn("Large pages aren't available (they need the \"Lock pages in memory\" privilege), using normal pages");
+        });
+    }
+
+    m_data = Allocate(nullptr, size, type);
+    if (m_data == nullptr)
+    {
+        throw std::runtime_error(fmt::format("Failed to reserve 0x{:x} bytes for slots (error {})", size, GetLastError()));
+    }
+    m_size = size;
+}
+
+char* SlotArena::Commit(uint64_t offset, uint64_t size)
+{
+    if (offset + size > m_size)
+    {
+        throw std::runtime_error(fmt::format("Range 0x{:x}-0x{:x} is outside of the slot arena", offset, offset + size));
+    }
+
+    // Sections can share pages, but committing a page that is already committed is fine
+    if (Allocate(m_data + offset, size, MEM_COMMIT) == nullptr)
+    {
+        throw std::runtime_error(fmt::format("Failed to commit 0x{:x} bytes of slots (error {})", size, GetLastError()));
+    }
+
+    return m_data + offset;
+}
+
+void SlotArena::Release()
+{
+    if (m_data != nullptr)
+    {
+        VirtualFree(m_data, 0, MEM_RELEASE);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+char* SlotArena::GetData() const
+{
+    return m_data;
+}
+
+uint64_t SlotArena::GetSize() const
+{
+    return m_size;
+}
+
+char* SlotArena::Allocate(char* address, uint64_t size, DWORD type)
+{
+    return static_cast<char*>(VirtualAllocExNuma(GetCurrentProcess(), address, size, type, PAGE_READWRITE, m_numaNode));
+}
+
+bool SlotArena::EnableLockMemoryPrivilege()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // AdjustTokenPrivileges succeeds without enabling anything if the account doesn't have the privilege
+    bool enabled = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+struct SlotArenaOptions
+{
+    bool LargePages = false; // Only used when everything is committed up front, and needs the "Lock pages in memory" privilege
+    bool NumaLocal = false; // Prefer memory on the NUMA node of the thread that reserves the arena
+};
+
+// Single block of memory that all of an RPak's slots are carved out of. The whole block is reserved at once, and
+// is either committed straight away or a range at a time as sections are loaded. Freeing it is one VirtualFree.
+class SlotArena
+{
+public:
+    SlotArena();
+    ~SlotArena();
+    SlotArena(const SlotArena&) = delete;
+    SlotArena& operator=(const SlotArena&) = delete;
+    void Reserve(uint64_t size, bool commit, const SlotArenaOptions& options);
+    char* Commit(uint64_t offset, uint64_t size); // Returns a pointer to the start of the range
+    void Release();
+    char* GetData() const;
+    uint64_t GetSize() const;
+
+private:
+    char* Allocate(char* address, uint64_t size, DWORD type);
+    static bool EnableLockMemoryPrivilege();
+
+    char* m_data;
+    uint64_t m_size;
+    DWORD m_numaNode;
+};
@@ -0,0 +1,263 @@
+#include "pch.h"
+
+const uint64_t kMaxBatchReadGap = 0x100000; // Cheaper to read through than to seek over, even on an SSD
+const uint64_t kMaxBatchReadSize = 0x4000000;
+
+StarpakFile::StarpakFile(const std::string& path) :
+    m_path(path),
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr),
+    m_view(nullptr),
+    m_size(0),
+    m_entries(nullptr),
+    m_numEntries(0)
+{
+    spdlog::get("logger")->debug("Opening starpak: {}", path);
+
+    // Open and map the file
+    // Overlapped, so reads from different threads aren't serialised on the file like they would be for a synchronous handle
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_file, &fileSize) || fileSize.QuadPart < 16)
+    {
+        Close();
+        throw std::runtime_error(fmt::format("{} is not a valid starpak file", path));
+    }
+    m_size = fileSize.QuadPart;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping != nullptr)
+    {
+        m_view = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+
+    if (m_view == nullptr)
+    {
+        DWORD error = GetLastError();
+        Close();
+        throw std::runtime_error(fmt::format("Failed to map {} (error {})", path, error));
+    }
+
+    // Check the magic matches
+    uint32_t magic = *reinterpret_cast<const uint32_t*>(m_view);
+    if (magic != 0x6B505253)
+    {
+        Close();
+        throw std::runtime_error(fmt::format("{} is not a valid starpak file", path));
+    }
+
+    // Check the version matches
+    uint32_t version = *reinterpret_cast<const uint32_t*>(m_view + 4);
+    if (version != 1)
+    {
+        Close();
+        throw std::runtime_error(fmt::format("{} is not a version 1 starpak file (version = {})", path, version));
+    }
+
+    // The entry table is at the end of the file
+    m_numEntries = *reinterpret_cast<const uint64_t*>(m_view + m_size - 8);
+    if (m_numEntries > (m_size - 16) / sizeof(Entry))
+    {
+        Close();
+        throw std::runtime_error(fmt::format("{} has more entries ({}) than fit in the file", path, m_numEntries));
+    }
+
+    m_entries = reinterpret_cast<const Entry*>(m_view + m_size - 8 - (m_numEntries * sizeof(Entry)));
+    auto byOffset = [](const Entry& a, const Entry& b) { return a.Offset < b.Offset; };
+    if (!std::is_sorted(m_entries, m_entries + m_numEntries, byOffset))
+    {
+        m_sortedEntries.assign(m_entries, m_entries + m_numEntries);
+        std::sort(m_sortedEntries.begin(), m_sortedEntries.end(), byOffset);
+        m_entries = m_sortedEntries.data();
+    }
+}
+
+StarpakFile::~StarpakFile()
+{
+    Close();
+}
+
+const std::string& StarpakFile::GetPath() const
+{
+    return m_path;
+}
+
+StarpakData StarpakFile::GetData(size_t offset) const
+{
+    const Entry* entry = FindEntry(offset);
+    if (entry == nullptr)
+    {
+        throw std::runtime_error(fmt::format("Offset {} is not in the entry table of {}", offset, m_path));
+    }
+
+    if (offset > m_size || entry->Size > m_size - offset)
+    {
+        throw std::runtime_error(fmt::format("Entry at offset {} in {} runs past the end of the file", offset, m_path));
+    }
+
+    return { m_view + offset, entry->Size };
+}
+
+std::vector<uint8_t> StarpakFile::ReadData(size_t offset) const
+{
+    StarpakData data = GetData(offset);
+    std::vector<uint8_t> buffer(data.Size);
+    ReadRange(offset, buffer.data(), data.Size);
+    return buffer;
+}
+
+void StarpakFile::ReadBatch(std::vector<StarpakReadRequest> requests) const
+{
+    // Work out which entries each request wants before reading anything, so a bad offset doesn't leave the batch half done
+    std::vector<std::pair<const Entry*, const StarpakReadRequest*>> entries;
+    entries.reserve(requests.size());
+    for (const auto& request : requests)
+    {
+        GetData(request.Offset); // Throws if the entry is missing or runs past the end of the file
+        entries.emplace_back(FindEntry(request.Offset), &request);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first->Offset < b.first->Offset; });
+
+    // Entries that are close enough together are read as one run, even if that means reading a gap between them too
+    std::vector<uint8_t> buffer;
+    size_t first = 0;
+    while (first < entries.size())
+    {
+        uint64_t runStart = entries[first].first->Offset;
+        uint64_t runEnd = runStart + entries[first].first->Size;
+        size_t last = first + 1;
+        while (last < entries.size())
+        {
+            const Entry* next = entries[last].first;
+            uint64_t nextEnd = std::max(runEnd, next->Offset + next->Size);
+            if (next->Offset > runEnd + kMaxBatchReadGap || nextEnd - runStart > kMaxBatchReadSize)
+            {
+                break;
+            }
+
+            runEnd = nextEnd;
+            last++;
+        }
+
+        buffer.resize(runEnd - runStart);
+        ReadRange(runStart, buffer.data(), buffer.size());
+        for (size_t i = first; i < last; i++)
+        {
+            const Entry* entry = entries[i].first;
+            entries[i].second->Callback(buffer.data() + (entry->Offset - runStart), entry->Size);
+        }
+
+        first = last;
+    }
+}
+
+void StarpakFile::Prefetch(const std::vector<size_t>& offsets) const
+{
+    std::vector<WIN32_MEMORY_RANGE_ENTRY> ranges;
+    for (size_t offset : offsets)
+    {
+        const Entry* entry = FindEntry(offset);
+        if (entry != nullptr && offset <= m_size && entry->Size <= m_size - offset)
+        {
+            ranges.push_back({ const_cast<uint8_t*>(m_view + offset), entry->Size });
+        }
+    }
+
+    // This is only a hint, so there's nothing to do if it doesn't work
+    if (!ranges.empty() && !PrefetchVirtualMemory(GetCurrentProcess(), ranges.size(), ranges.data(), 0))
+    {
+        spdlog::get("logger")->debug("Failed to prefetch {} entries of {} (error {})", ranges.size(), m_path, GetLastError());
+    }
+}
+
+void StarpakFile::ReadRange(uint64_t offset, uint8_t* buffer, size_t size) const
+{
+    // Each read says where it starts, so there's no shared file position for threads to fight over. This is also
+    // one large read, where copying from the mapping would fault the data in a page at a time.
+    HANDLE event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    if (event == nullptr)
+    {
+        throw std::runtime_error(fmt::format("Failed to create event for reading {} (error {})", m_path, GetLastError()));
+    }
+
+    size_t bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+    while (bytesRead < size && error == ERROR_SUCCESS)
+    {
+        OVERLAPPED overlapped = {};
+        uint64_t position = offset + bytesRead;
+        overlapped.Offset = static_cast<DWORD>(position);
+        overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+        overlapped.hEvent = event;
+
+        DWORD toRead = static_cast<DWORD>(std::min<size_t>(size - bytesRead, 0x40000000));
+        DWORD read = 0;
+        if (!ReadFile(m_file, buffer + bytesRead, toRead, nullptr, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+        {
+            error = GetLastError();
+        }
+        else if (!GetOverlappedResult(m_file, &overlapped, &read, TRUE))
+        {
+            error = GetLastError();
+        }
+        else if (read == 0)
+        {
+            error = ERROR_HANDLE_EOF;
+        }
+        bytesRead += read;
+    }
+    CloseHandle(event);
+
+    if (error != ERROR_SUCCESS)
+    {
+        throw std::runtime_error(fmt::format("Failed to read 0x{:x} bytes at offset {} from {} (error {})", size, offset, m_path, error));
+    }
+}
+
+const StarpakFile::Entry* StarpakFile::FindEntry(size_t offset) const
+{
+    if (m_numEntries == 0)
+    {
+        return nullptr;
+    }
+
+    // Branchless binary search - the loop always runs log2(n) times and the select compiles to a cmov,
+    // so there are no mispredicted branches however the offsets being looked up are ordered
+    const Entry* base = m_entries;
+    uint64_t count = m_numEntries;
+    while (count > 1)
+    {
+        uint64_t half = count / 2;
+        base = base[half].Offset <= offset ? base + half : base;
+        count -= half;
+    }
+
+    return base->Offset == offset ? base : nullptr;
+}
+
+void StarpakFile::Close()
+{
+    if (m_view != nullptr)
+    {
+        UnmapViewOfFile(m_view);
+        m_view = nullptr;
+    }
+
+    if (m_mapping != nullptr)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+}
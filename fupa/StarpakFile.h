@@ -0,0 +1,54 @@
+#pragma once
+
+// Read-only view of a starpak entry. Points straight into the mapped file, so it is only valid while the StarpakFile is.
+struct StarpakData
+{
+    const uint8_t* Data;
+    size_t Size;
+};
+
+typedef std::function<void(const uint8_t* data, size_t size)> tStarpakReadCallback; // data is only valid during the call
+
+struct StarpakReadRequest
+{
+    size_t Offset;
+    tStarpakReadCallback Callback;
+};
+
+// A starpak mapped into memory, so entries can be used in place instead of being copied out of the file.
+// Nothing changes after construction, so any number of threads can read from it at once.
+class StarpakFile
+{
+public:
+    StarpakFile(const std::string& path);
+    ~StarpakFile();
+    StarpakFile(const StarpakFile&) = delete;
+    StarpakFile& operator=(const StarpakFile&) = delete;
+    const std::string& GetPath() const;
+    StarpakData GetData(size_t offset) const;
+    std::vector<uint8_t> ReadData(size_t offset) const; // Copy of the entry, read with positional I/O rather than through the mapping
+    void ReadBatch(std::vector<StarpakReadRequest> requests) const; // Reads the entries in file order, calling back as each one is read
+    void Prefetch(const std::vector<size_t>& offsets) const; // Asks the OS to start reading in entries that will be needed soon
+
+private:
+    struct Entry
+    {
+        uint64_t Offset;
+        uint64_t Size;
+    };
+
+    void Close();
+    const Entry* FindEntry(size_t offset) const;
+    void ReadRange(uint64_t offset, uint8_t* buffer, size_t size) const;
+
+    std::string m_path;
+    HANDLE m_file;
+    HANDLE m_mapping;
+    const uint8_t* m_view;
+    uint64_t m_size;
+
+    // Entries sorted by offset. This is the table at the end of the mapped file when it is already sorted, which saves copying it.
+    const Entry* m_entries;
+    uint64_t m_numEntries;
+    std::vector<Entry> m_sortedEntries;
+};
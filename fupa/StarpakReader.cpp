@@ -2,112 +2,107 @@
 
 void StarpakReader::AddStarpakFile(const std::filesystem::path& basePath, const std::string& name)
 {
-    AddStarpakInternal(basePath, name, m_starpakFiles, m_starpakOffsetMaps);
+    AddStarpakInternal(basePath, name, m_starpakFiles);
 }
 
-std::vector<uint8_t> StarpakReader::ReadStarpakData(uint32_t index, size_t offset)
+StarpakData StarpakReader::GetStarpakData(uint32_t index, size_t offset) const
 {
-    return ReadStarpakInternal(index, offset, m_starpakFiles, m_starpakOffsetMaps);
+    return GetStarpakInternal(index, m_starpakFiles).GetData(offset);
 }
 
-#ifdef APEX
-void StarpakReader::AddFullStarpakFile(const std::filesystem::path& basePath, const std::string& name)
+std::vector<uint8_t> StarpakReader::ReadStarpakData(uint32_t index, size_t offset) const
 {
-    AddStarpakInternal(basePath, name, m_fullStarpakFiles, m_fullStarpakOffsetMaps);
+    return ReadDataInternal(index, offset, m_starpakFiles, *m_batchedEntries);
 }
 
-std::vector<uint8_t> StarpakReader::ReadFullStarpakData(uint32_t index, size_t offset)
+void StarpakReader::PrefetchStarpakData(uint32_t index, const std::vector<size_t>& offsets) const
 {
-    return ReadStarpakInternal(index, offset, m_fullStarpakFiles, m_fullStarpakOffsetMaps);
+    if (index < m_starpakFiles.size())
+    {
+        m_starpakFiles[index]->Prefetch(offsets);
+    }
 }
-#endif
 
-struct StarpakEntry
+void StarpakReader::ReadStarpakBatch(const std::vector<StarpakEntryRef>& entries) const
 {
-    uint64_t Offset;
-    uint64_t Size;
-};
-
-void StarpakReader::AddStarpakInternal(
-    const std::filesystem::path& basePath,
-    const std::string& name,
-    std::vector<std::ifstream>& starpakFiles,
-    std::vector<std::unordered_map<size_t, size_t>>& starpakOffsetMaps)
+    ReadBatchInternal(entries, m_starpakFiles, *m_batchedEntries);
+}
+
+#ifdef APEX
+void StarpakReader::AddFullStarpakFile(const std::filesystem::path& basePath, const std::string& name)
 {
-    auto logger = spdlog::get("logger");
-    std::string path = (basePath / name).string();
-    logger->debug("Opening starpak: {}", path);
+    AddStarpakInternal(basePath, name, m_fullStarpakFiles);
+}
 
-    // Open the file
-    std::ifstream f(path, std::ios::in | std::ios::binary);
-    if (!f.is_open())
-    {
-        throw std::runtime_error("Failed to open file");
-    }
+StarpakData StarpakReader::GetFullStarpakData(uint32_t index, size_t offset) const
+{
+    return GetStarpakInternal(index, m_fullStarpakFiles).GetData(offset);
+}
 
-    // Check the magic matches
-    uint32_t magic;
-    f.read(reinterpret_cast<char*>(&magic), 4);
-    if (magic != 0x6B505253)
-    {
-        throw std::runtime_error(fmt::format("{} is not a valid starpak file", name));
-    }
+std::vector<uint8_t> StarpakReader::ReadFullStarpakData(uint32_t index, size_t offset) const
+{
+    return ReadDataInternal(index, offset, m_fullStarpakFiles, *m_fullBatchedEntries);
+}
 
-    // Check the version matches
-    uint32_t version;
-    f.read(reinterpret_cast<char*>(&version), 4);
-    if (version != 1)
+void StarpakReader::PrefetchFullStarpakData(uint32_t index, const std::vector<size_t>& offsets) const
+{
+    if (index < m_fullStarpakFiles.size())
     {
-        throw std::runtime_error(fmt::format("{} is not a version 1 starpak file (version = {})", name, version));
+        m_fullStarpakFiles[index]->Prefetch(offsets);
     }
+}
 
-    // Read the entries into a map
-    f.seekg(-8, std::ios_base::end);
-    int64_t numEntries;
-    f.read(reinterpret_cast<char*>(&numEntries), 8);
+void StarpakReader::ReadFullStarpakBatch(const std::vector<StarpakEntryRef>& entries) const
+{
+    ReadBatchInternal(entries, m_fullStarpakFiles, *m_fullBatchedEntries);
+}
+#endif
 
-    std::unordered_map<size_t, size_t> entryOffsetMap(numEntries);
-    f.seekg(-numEntries * sizeof(StarpakEntry) - 8, std::ios_base::end);
+void StarpakReader::AddStarpakInternal(const std::filesystem::path& basePath, const std::string& name, std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles)
+{
+    starpakFiles.push_back(StarpakRegistry::Get().Open(basePath / name));
+}
 
-    for (int64_t i = 0; i < numEntries; i++)
+std::vector<uint8_t> StarpakReader::ReadDataInternal(uint32_t index, size_t offset, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles, BatchedEntries& batchedEntries) const
+{
     {
-        StarpakEntry entry;
-        f.read(reinterpret_cast<char*>(&entry), sizeof(StarpakEntry));
-        entryOffsetMap.emplace(entry.Offset, entry.Size);
+        std::lock_guard<std::mutex> lock(batchedEntries.Mutex);
+        auto it = batchedEntries.Entries.find({ index, offset });
+        if (it != batchedEntries.Entries.end())
+        {
+            std::vector<uint8_t> data = std::move(it->second);
+            batchedEntries.Entries.erase(it);
+            return data;
+        }
     }
 
-    // Add the map and file into the supplied vectors
-    starpakOffsetMaps.emplace_back(std::move(entryOffsetMap));
-    starpakFiles.emplace_back(std::move(f));
+    return GetStarpakInternal(index, starpakFiles).ReadData(offset);
 }
 
-std::vector<uint8_t> StarpakReader::ReadStarpakInternal(
-    uint32_t index,
-    size_t offset,
-    std::vector<std::ifstream>& starpakFiles,
-    std::vector<std::unordered_map<size_t, size_t>>& starpakOffsetMaps)
+void StarpakReader::ReadBatchInternal(const std::vector<StarpakEntryRef>& entries, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles, BatchedEntries& batchedEntries) const
 {
-    // Lookup the size in the map
-    if (index >= starpakOffsetMaps.size())
+    std::map<uint32_t, std::vector<StarpakReadRequest>> requestsByStarpak;
+    for (const auto& entry : entries)
     {
-        throw std::runtime_error("Starpak index out of bounds");
+        requestsByStarpak[entry.Index].push_back({ entry.Offset, [&batchedEntries, entry](const uint8_t* data, size_t size) {
+            std::vector<uint8_t> copy(data, data + size);
+            std::lock_guard<std::mutex> lock(batchedEntries.Mutex);
+            batchedEntries.Entries[{ entry.Index, entry.Offset }] = std::move(copy);
+        } });
     }
 
-    auto& offsetMap = starpakOffsetMaps[index];
-    auto it = offsetMap.find(offset);
-    if (it == offsetMap.end())
+    for (auto& [index, starpakRequests] : requestsByStarpak)
     {
-        throw std::runtime_error(fmt::format("Offset {} not found in offset map for index {}", offset, index));
+        GetStarpakInternal(index, starpakFiles).ReadBatch(std::move(starpakRequests));
     }
+}
 
-    size_t entrySize = it->second;
-
-    // Seek to the offset and read the data
-    auto& f = starpakFiles[index];
-    f.seekg(offset);
-
-    std::vector<uint8_t> data(entrySize);
-    f.read(reinterpret_cast<char*>(data.data()), entrySize);
+const StarpakFile& StarpakReader::GetStarpakInternal(uint32_t index, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles) const
+{
+    if (index >= starpakFiles.size())
+    {
+        throw std::runtime_error("Starpak index out of bounds");
+    }
 
-    return std::move(data);
+    return *starpakFiles[index];
 }
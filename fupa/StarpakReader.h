@@ -1,23 +1,47 @@
 #pragma once
 
+// Where an asset's data is in the starpaks
+struct StarpakEntryRef
+{
+    uint32_t Index; // Which of the reader's starpaks it is in
+    size_t Offset;
+};
+
+// Reads from the starpaks an RPak refers to, which are shared with other readers through StarpakRegistry.
+// Once every starpak has been added, the reader can be shared by any number of threads.
 class StarpakReader
 {
 public:
     void AddStarpakFile(const std::filesystem::path& basePath, const std::string& name);
-    std::vector<uint8_t> ReadStarpakData(uint32_t index, size_t offset);
+    StarpakData GetStarpakData(uint32_t index, size_t offset) const; // Points into the mapped starpak, which stays mapped as long as anything holds the shared StarpakFile (StarpakRegistry keeps it until exit)
+    std::vector<uint8_t> ReadStarpakData(uint32_t index, size_t offset) const; // Copy of GetStarpakData. An entry read by ReadStarpakBatch is handed over the first time it's asked for instead of being read again.
+    void PrefetchStarpakData(uint32_t index, const std::vector<size_t>& offsets) const; // Only a hint, so offsets that aren't in the starpak are ignored
+    void ReadStarpakBatch(const std::vector<StarpakEntryRef>& entries) const; // Reads entries about to be dumped one starpak at a time in file order, coalescing nearby ones, and keeps them for ReadStarpakData
 #ifdef APEX
     void AddFullStarpakFile(const std::filesystem::path& basePath, const std::string& name);
-    std::vector<uint8_t> ReadFullStarpakData(uint32_t index, size_t offset);
+    StarpakData GetFullStarpakData(uint32_t index, size_t offset) const;
+    std::vector<uint8_t> ReadFullStarpakData(uint32_t index, size_t offset) const;
+    void PrefetchFullStarpakData(uint32_t index, const std::vector<size_t>& offsets) const;
+    void ReadFullStarpakBatch(const std::vector<StarpakEntryRef>& entries) const;
 #endif
 
 private:
-    void AddStarpakInternal(const std::filesystem::path& basePath, const std::string& name, std::vector<std::ifstream>& starpakFiles, std::vector<std::unordered_map<size_t, size_t>>& starpakOffsetMaps);
-    std::vector<uint8_t> ReadStarpakInternal(uint32_t index, size_t offset, std::vector<std::ifstream>& starpakFiles, std::vector<std::unordered_map<size_t, size_t>>& starpakOffsetMaps);
+    // Entries read by a batch that nothing has asked for yet
+    struct BatchedEntries
+    {
+        std::mutex Mutex;
+        std::map<std::pair<uint32_t, size_t>, std::vector<uint8_t>> Entries;
+    };
+
+    void AddStarpakInternal(const std::filesystem::path& basePath, const std::string& name, std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles);
+    std::vector<uint8_t> ReadDataInternal(uint32_t index, size_t offset, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles, BatchedEntries& batchedEntries) const;
+    void ReadBatchInternal(const std::vector<StarpakEntryRef>& entries, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles, BatchedEntries& batchedEntries) const;
+    const StarpakFile& GetStarpakInternal(uint32_t index, const std::vector<std::shared_ptr<const StarpakFile>>& starpakFiles) const;
 
-    std::vector<std::ifstream> m_starpakFiles;
-    std::vector<std::unordered_map<size_t, size_t>> m_starpakOffsetMaps;
+    std::vector<std::shared_ptr<const StarpakFile>> m_starpakFiles;
+    std::unique_ptr<BatchedEntries> m_batchedEntries = std::make_unique<BatchedEntries>(); // Behind a pointer so the reader can still be moved
 #ifdef APEX
-    std::vector<std::ifstream> m_fullStarpakFiles;
-    std::vector<std::unordered_map<size_t, size_t>> m_fullStarpakOffsetMaps;
+    std::vector<std::shared_ptr<const StarpakFile>> m_fullStarpakFiles;
+    std::unique_ptr<BatchedEntries> m_fullBatchedEntries = std::make_unique<BatchedEntries>();
 #endif
 };
@@ -0,0 +1,49 @@
+#include "pch.h"
+
+StarpakRegistry& StarpakRegistry::Get()
+{
+    static StarpakRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<const StarpakFile> StarpakRegistry::Open(const std::filesystem::path& path)
+{
+    std::string key = std::filesystem::absolute(path).lexically_normal().string();
+    std::transform(key.begin(), key.end(), key.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+
+    // Whoever asks for a starpak first opens it, without holding the lock, and anyone else asking for it meanwhile waits for them
+    std::promise<std::shared_ptr<const StarpakFile>> promise;
+    tStarpakFuture existing;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_starpaks.find(key);
+        if (it != m_starpaks.end())
+        {
+            existing = it->second;
+        }
+        else
+        {
+            m_starpaks.emplace(key, promise.get_future().share());
+        }
+    }
+
+    if (existing.valid())
+    {
+        return existing.get();
+    }
+
+    try
+    {
+        auto starpak = std::make_shared<const StarpakFile>(path.string());
+        promise.set_value(starpak);
+        return starpak;
+    }
+    catch (...)
+    {
+        // Don't remember the failure, so the starpak can be tried again (e.g. once it has been downloaded)
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_starpaks.erase(key);
+        throw;
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Opens each starpak once per process and shares it between every StarpakReader that refers to it. Starpaks stay
+// open until the process exits, so batch jobs don't map and index the same few large starpaks for every RPak.
+class StarpakRegistry
+{
+public:
+    static StarpakRegistry& Get();
+    std::shared_ptr<const StarpakFile> Open(const std::filesystem::path& path);
+
+private:
+    typedef std::shared_future<std::shared_ptr<const StarpakFile>> tStarpakFuture;
+
+    StarpakRegistry() = default;
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, tStarpakFuture> m_starpaks; // By normalised path
+};
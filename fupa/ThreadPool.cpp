@@ -0,0 +1,151 @@
+#include "pch.h"
+
+ThreadPool::ThreadPool(size_t numThreads) :
+    m_queuedTasks(0),
+    m_pendingTasks(0),
+    m_idleWorkers(0),
+    m_nextQueue(0),
+    m_stop(false)
+{
+    if (numThreads == 0)
+    {
+        throw std::runtime_error("ThreadPool needs at least one thread");
+    }
+
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        m_threads.emplace_back(&ThreadPool::WorkerThread, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_workAvailable.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    m_pendingTasks++;
+    WorkerQueue& queue = *m_queues[m_nextQueue++ % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> queueLock(queue.Mutex);
+        queue.Tasks.push_back(std::move(task));
+    }
+    m_queuedTasks++;
+
+    // Workers count themselves as idle before checking for tasks, so either one of them sees this task or we see
+    // them here. Taking the lock first means a worker that is just about to wait can't miss the notification.
+    if (m_idleWorkers > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_workAvailable.notify_one();
+    }
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_workFinished.wait(lock, [this] { return m_pendingTasks == 0; });
+
+    if (m_error)
+    {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t ThreadPool::GetNumThreads() const
+{
+    return m_threads.size();
+}
+
+void ThreadPool::WorkerThread(size_t index)
+{
+    while (true)
+    {
+        std::function<void()> task;
+        if (!PopTask(index, task))
+        {
+            // Every queue is empty, so sleep until something else is submitted
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_idleWorkers++;
+            m_workAvailable.wait(lock, [this] { return m_stop || m_queuedTasks > 0; });
+            m_idleWorkers--;
+            if (m_stop)
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error)
+            {
+                m_error = std::current_exception();
+            }
+        }
+
+        FinishTask();
+    }
+}
+
+bool ThreadPool::PopTask(size_t index, std::function<void()>& task)
+{
+    // Tasks are taken in the order they were submitted, from our own queue first and then from the others.
+    // Callers submit the biggest jobs first, so this keeps them from being left until the end.
+    bool found = false;
+    for (size_t i = 0; i < m_queues.size() && !found; i++)
+    {
+        WorkerQueue& queue = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> queueLock(queue.Mutex);
+        if (queue.Tasks.empty())
+        {
+            continue;
+        }
+
+        task = std::move(queue.Tasks.front());
+        queue.Tasks.pop_front();
+        found = true;
+    }
+
+    if (found)
+    {
+        m_queuedTasks--;
+    }
+
+    return found;
+}
+
+void ThreadPool::FinishTask()
+{
+    // Wait checks the count while holding the lock, so it has to be taken to notify without the wakeup getting lost
+    if (--m_pendingTasks == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_workFinished.notify_all();
+    }
+}
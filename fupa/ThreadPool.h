@@ -0,0 +1,38 @@
+#pragma once
+
+// Fixed set of worker threads for running independent jobs (e.g. one per RPak). Each worker
+// has its own queue and steals from the other queues once its own is empty, so a few very
+// large jobs don't leave the remaining workers idle. Queues are only ever locked one at a time;
+// the pool-wide mutex is just for putting idle workers to sleep and for Wait.
+class ThreadPool
+{
+public:
+    ThreadPool(size_t numThreads);
+    ~ThreadPool();
+    void Submit(std::function<void()> task);
+    void Wait(); // Blocks until every submitted task has finished. Rethrows the first exception thrown by a task.
+    size_t GetNumThreads() const;
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex Mutex;
+        std::deque<std::function<void()>> Tasks;
+    };
+
+    void WorkerThread(size_t index);
+    bool PopTask(size_t index, std::function<void()>& task);
+    void FinishTask();
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_workFinished;
+    std::atomic<size_t> m_queuedTasks;
+    std::atomic<size_t> m_pendingTasks;
+    std::atomic<size_t> m_idleWorkers;
+    std::atomic<size_t> m_nextQueue;
+    bool m_stop;
+    std::exception_ptr m_error;
+};
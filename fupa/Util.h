@@ -6,4 +6,6 @@ std::filesystem::path GetRpakPath(std::filesystem::path basePath, std::string na
 void ReplaceAll(std::string& source, const std::string& from, const std::string& to);
 std::string HashToString(uint64_t hash);
 bool EndsWith(const std::string& value, const std::string& ending);
+bool WildcardMatch(const std::string& value, const std::string& pattern);
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325);
 }
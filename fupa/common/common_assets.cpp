@@ -355,7 +355,10 @@ public:
         }
 
         DirectX::ScratchImage image;
-        hr = DirectX::CaptureTexture(D3D::Device.Get(), D3D::DeviceContext.Get(), tex.Get(), image);
+        {
+            std::lock_guard<std::mutex> lock(D3D::DeviceContextMutex);
+            hr = DirectX::CaptureTexture(D3D::Device.Get(), D3D::DeviceContext.Get(), tex.Get(), image);
+        }
         if (FAILED(hr))
         {
             logger->error("Cannot dump texture {} - failed to CaptureTexture (0x{:x})", GetNameOrHash(), hr);
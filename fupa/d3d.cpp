@@ -3,6 +3,7 @@
 namespace D3D {
 Microsoft::WRL::ComPtr<ID3D11Device> Device;
 Microsoft::WRL::ComPtr<ID3D11DeviceContext> DeviceContext;
+std::mutex DeviceContextMutex;
 
 void Initialize()
 {
@@ -3,6 +3,7 @@
 namespace D3D {
 extern Microsoft::WRL::ComPtr<ID3D11Device> Device;
 extern Microsoft::WRL::ComPtr<ID3D11DeviceContext> DeviceContext;
+extern std::mutex DeviceContextMutex; // The device can be used from any thread, but the immediate context can't
 
 void Initialize();
 }
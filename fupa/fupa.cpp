@@ -1,9 +1,76 @@
 #include "pch.h"
 
-std::unique_ptr<IDecompressedFileReader> FileReaderFactory(const std::string& inputDir, const std::string& rpakName, int number)
+struct FileReaderOptions
+{
+    bool AsyncPrefetch = false;
+    bool UseCheckpoints = false;
+    std::string CacheDir;
+    std::string FlattenedDir;
+};
+
+// Cache entries are named after a hash of the compressed file's header and identity, so a
+// file that changes in any way (e.g. a game update) gets a new entry
+std::filesystem::path GetDecompressedCachePath(const std::string& cacheDir, const std::string& path, const OuterHeader& header, size_t size)
+{
+    std::string fileName = std::filesystem::path(path).filename().string();
+    int64_t writeTime = std::filesystem::last_write_time(path).time_since_epoch().count();
+
+    uint64_t hash = Util::HashBytes(&header, sizeof(OuterHeader));
+    hash = Util::HashBytes(&size, sizeof(size), hash);
+    hash = Util::HashBytes(&writeTime, sizeof(writeTime), hash);
+    hash = Util::HashBytes(fileName.data(), fileName.size(), hash);
+
+    return std::filesystem::path(cacheDir) / fmt::format("{}.{:016x}.rpak", std::filesystem::path(path).stem().string(), hash);
+}
+
+// Patches are named name(NN).rpak, so the latest version installed is the one with the highest number
+bool IsLatestInstalledRPak(const std::string& inputDir, const std::string& rpakName, int number)
+{
+    std::filesystem::path directory = Util::GetRpakPath(inputDir, rpakName, 0).parent_path();
+    std::string pattern = rpakName + "(*).rpak";
+    for (auto& entry : std::filesystem::directory_iterator(directory))
+    {
+        std::string fileName = entry.path().filename().string();
+        if (!entry.is_regular_file() || !Util::WildcardMatch(fileName, pattern))
+        {
+            continue;
+        }
+
+        std::string numberStr = fileName.substr(rpakName.size() + 1, fileName.size() - pattern.size() + 1);
+        bool isNumber = !numberStr.empty() && numberStr.size() < 10 && std::all_of(numberStr.begin(), numberStr.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)) != 0; });
+        if (isNumber && std::stoi(numberStr) > number)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::unique_ptr<IDecompressedFileReader> FileReaderFactory(const std::string& inputDir, const FileReaderOptions& options, const std::string& rpakName, int number)
 {
     auto logger = spdlog::get("logger");
     std::string path = Util::GetRpakPath(inputDir, rpakName, number).string();
+
+    // A pak written by the flatten command already has its whole patch chain applied. That's only what's wanted
+    // while it is the latest version - once a newer patch is installed, this is being opened as one of that
+    // patch's links, and the patch has to be replayed on top of the original.
+    if (!options.FlattenedDir.empty())
+    {
+        std::filesystem::path flattenedPath = Util::GetRpakPath(options.FlattenedDir, rpakName, number);
+        if (std::filesystem::exists(flattenedPath))
+        {
+            if (IsLatestInstalledRPak(inputDir, rpakName, number))
+            {
+                path = flattenedPath.string();
+            }
+            else
+            {
+                logger->debug("Not using {} - a newer patch of {} is installed", flattenedPath.string(), rpakName);
+            }
+        }
+    }
+
     logger->debug("Opening rpak: {}", path);
 
     // Pre-parse the header to see if the file is compressed or not
@@ -50,8 +117,39 @@ std::unique_ptr<IDecompressedFileReader> FileReaderFactory(const std::string& in
         throw std::runtime_error(fmt::format("Size of {} (0x{:x}) does not match compressed size in header (0x{:x})", path, size, header.CompressedSize));
     }
 
+    std::filesystem::path cachePath;
+    if (!options.CacheDir.empty())
+    {
+        cachePath = GetDecompressedCachePath(options.CacheDir, path, header, size);
+
+        // The decompressed data starts with the same header as the compressed file, so a copy that was
+        // left half written or belongs to some other file won't match it
+        std::error_code ec;
+        if (std::filesystem::file_size(cachePath, ec) == header.DecompressedSize && !ec)
+        {
+            OuterHeader cachedHeader;
+            std::ifstream cached(cachePath, std::ios::in | std::ios::binary);
+            cached.read(reinterpret_cast<char*>(&cachedHeader), sizeof(OuterHeader));
+            if (!cached.fail() && memcmp(&cachedHeader, &header, sizeof(OuterHeader)) == 0)
+            {
+                logger->debug("Found decompressed copy in cache, opening {} with PreprocessedFileReader", cachePath.string());
+                return std::make_unique<PreprocessedFileReader>(cachePath.string());
+            }
+
+            logger->debug("Decompressed copy in {} doesn't match {}, decompressing again", cachePath.string(), path);
+        }
+    }
+
     logger->debug("File is compressed, opening with CompressedFileReader");
-    return std::make_unique<CompressedFileReader>(path);
+    auto reader = std::make_unique<CompressedFileReader>(path, options.AsyncPrefetch, options.UseCheckpoints);
+    if (!cachePath.empty())
+    {
+        logger->debug("Caching decompressed copy in {}", cachePath.string());
+        std::filesystem::create_directories(options.CacheDir);
+        reader->CacheDecompressedData(cachePath.string());
+    }
+
+    return reader;
 }
 
 void VerbosityCallback(size_t count)
@@ -120,21 +218,128 @@ struct DecompressParams
     std::string BinDir;
     std::string RPakFile;
     std::string OutputFile = "decompressed.rpak";
+    bool Prefetch = false;
+    uint64_t CheckpointInterval = 0;
+    size_t NumJobs = std::max(1U, std::thread::hardware_concurrency());
 };
 
+void DecompressFile(const std::string& inputFile, const std::string& outputFile, const DecompressParams& params)
+{
+    auto logger = spdlog::get("logger");
+    logger->info("Decompressing {} to {}", inputFile, outputFile);
+
+    // Write to a temporary file first so a cancelled run never leaves a truncated output behind
+    std::string tempFile = outputFile + ".tmp";
+    {
+        std::ofstream outFile(tempFile, std::ios::out | std::ios::binary);
+        if (!outFile.is_open())
+        {
+            throw std::runtime_error(fmt::format("Failed to open output file {}", tempFile));
+        }
+
+        // Create reader
+        auto reader = std::make_unique<CompressedFileReader>(inputFile, params.Prefetch);
+        logger->debug("Decompressed size of {}: 0x{:x}", inputFile, reader->GetFileSize());
+
+        if (params.CheckpointInterval != 0)
+        {
+            reader->RecordCheckpoints(params.CheckpointInterval * 1024 * 1024);
+        }
+
+        // Read out chunks of the file and write them to the output file
+        const uint64_t kBufSize = 0x400000;
+        std::unique_ptr<char[]> buf = std::make_unique<char[]>(kBufSize);
+        uint64_t bytesRead = 0;
+        while (bytesRead != reader->GetFileSize())
+        {
+            uint64_t toRead = std::min(reader->GetFileSize() - bytesRead, kBufSize);
+            reader->ReadData(buf.get(), toRead, 0);
+            outFile.write(buf.get(), toRead);
+            bytesRead += toRead;
+        }
+
+        if (outFile.fail())
+        {
+            throw std::runtime_error(fmt::format("Failed to write output file {}", tempFile));
+        }
+    }
+
+    std::filesystem::rename(tempFile, outputFile);
+}
+
+// Returns true if the file is a compressed RPak as it comes from the game
+bool IsCompressedRPak(const std::filesystem::path& path, OuterHeader& header)
+{
+    std::ifstream f(path, std::ios::in | std::ios::binary);
+    if (!f.is_open())
+    {
+        return false;
+    }
+
+    f.read(reinterpret_cast<char*>(&header), sizeof(OuterHeader));
+    if (f.fail() || header.Signature != kRpakSignature || (header.Flags & 0x100) == 0)
+    {
+        return false;
+    }
+
+    return std::filesystem::file_size(path) == header.CompressedSize;
+}
+
+// A previous decompression is up to date if it is the right size and starts with the same header,
+// which includes the creation time and compressed size of the RPak it came from
+bool IsDecompressedOutputCurrent(const std::filesystem::path& outputFile, const OuterHeader& header)
+{
+    std::error_code ec;
+    if (std::filesystem::file_size(outputFile, ec) != header.DecompressedSize || ec)
+    {
+        return false;
+    }
+
+    std::ifstream f(outputFile, std::ios::in | std::ios::binary);
+    OuterHeader outputHeader;
+    f.read(reinterpret_cast<char*>(&outputHeader), sizeof(OuterHeader));
+    return !f.fail() && memcmp(&outputHeader, &header, sizeof(OuterHeader)) == 0;
+}
+
+std::vector<std::filesystem::path> FindRPakFiles(const std::filesystem::path& input)
+{
+    // Input is either a directory (all RPaks inside it) or a file name pattern such as paks/Win64/mp_*.rpak
+    std::filesystem::path directory = input;
+    std::string pattern = "*.rpak";
+    if (!std::filesystem::is_directory(input))
+    {
+        directory = input.parent_path().empty() ? "." : input.parent_path();
+        pattern = input.filename().string();
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (auto& p : std::filesystem::directory_iterator(directory))
+    {
+        if (p.is_regular_file() && Util::WildcardMatch(p.path().filename().string(), pattern))
+        {
+            files.push_back(p.path());
+        }
+    }
+
+    return files;
+}
+
 void AddDecompressCommand(CLI::App& app)
 {
-    CLI::App* command = app.add_subcommand("decompress", "Decompress an RPak file");
+    CLI::App* command = app.add_subcommand("decompress", "Decompress an RPak file, or every RPak in a directory");
 
     auto params = std::make_shared<DecompressParams>();
     command->add_option("-b,--bindir", params->BinDir, "Path to x64_retail in your Titanfall 2 folder")
         ->required();
     command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
-    command->add_option("rpak_file", params->RPakFile, "Path to RPak file to decompress")
+    command->add_flag("--prefetch", params->Prefetch, "Read compressed data on a background thread while decompressing");
+    command->add_option("--checkpoints", params->CheckpointInterval, "Also write decoder checkpoints every N MiB to a sidecar file next to the RPak (0 to disable)", true);
+    command->add_option("-j,--jobs", params->NumJobs, "Number of RPaks to decompress at once when decompressing a directory", true);
+    command->add_option("rpak_file", params->RPakFile, "Path to RPak file to decompress, or a directory or pattern (e.g. paks/Win64/*.rpak) to decompress many")
         ->required();
-    command->add_option("output_file", params->OutputFile, "Path to output file", true);
+    CLI::Option* outputOption = command->add_option("output_file", params->OutputFile, "Path to output file, or output directory when decompressing many", true);
 
-    command->callback([params]() {
+    command->callback([params, outputOption]() {
         auto logger = spdlog::get("logger");
 
         // Check that bindir exists
@@ -147,29 +352,65 @@ void AddDecompressCommand(CLI::App& app)
         // Initialize rtech functions
         rtech::Initialize(params->BinDir);
 
-        logger->info("Decompressing {} to {}", params->RPakFile, params->OutputFile);
+        std::filesystem::path input = params->RPakFile;
+        std::string inputName = input.filename().string();
+        bool isBatch = std::filesystem::is_directory(input) || inputName.find_first_of("*?") != std::string::npos;
+        if (!isBatch)
+        {
+            DecompressFile(params->RPakFile, params->OutputFile, *params);
+            logger->info("Decompression complete!");
+            return;
+        }
+
+        std::filesystem::path outputDir = outputOption->count() > 0 ? params->OutputFile : "decompressed";
+        std::filesystem::create_directories(outputDir);
 
-        // Create output file
-        std::ofstream outFile(params->OutputFile, std::ios::out | std::ios::binary);
-        if (!outFile.is_open())
+        // Work out which files actually need decompressing
+        std::vector<std::pair<std::filesystem::path, uint64_t>> jobs;
+        for (const auto& file : FindRPakFiles(input))
         {
-            throw std::runtime_error("Failed to open output file");
+            OuterHeader header;
+            if (!IsCompressedRPak(file, header))
+            {
+                logger->debug("Skipping {} - not a compressed RPak", file.string());
+                continue;
+            }
+
+            if (IsDecompressedOutputCurrent(outputDir / file.filename(), header))
+            {
+                logger->debug("Skipping {} - already decompressed", file.string());
+                continue;
+            }
+
+            jobs.emplace_back(file, header.CompressedSize);
         }
 
-        // Create reader
-        auto reader = std::make_unique<CompressedFileReader>(params->RPakFile);
-        logger->info("Decompressed size: 0x{:x}", reader->GetFileSize());
+        // Start the biggest files first so they don't end up as a long tail
+        std::sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
 
-        // Read out chunks of the file and write them to the output file
-        const uint64_t kBufSize = 0x400000;
-        std::unique_ptr<char[]> buf = std::make_unique<char[]>(kBufSize);
-        uint64_t bytesRead = 0;
-        while (bytesRead != reader->GetFileSize())
+        logger->info("Decompressing {} RPaks using {} threads", jobs.size(), params->NumJobs);
+        std::atomic<size_t> numFailed = 0;
+        ThreadPool pool(std::max<size_t>(1, params->NumJobs));
+        for (const auto& job : jobs)
         {
-            uint64_t toRead = std::min(reader->GetFileSize() - bytesRead, kBufSize);
-            reader->ReadData(buf.get(), toRead, 0);
-            outFile.write(buf.get(), toRead);
-            bytesRead += toRead;
+            std::filesystem::path inputFile = job.first;
+            pool.Submit([inputFile, outputDir, params, &numFailed]() {
+                try
+                {
+                    DecompressFile(inputFile.string(), (outputDir / inputFile.filename()).string(), *params);
+                }
+                catch (const std::exception& e)
+                {
+                    spdlog::get("logger")->error("Failed to decompress {}: {}", inputFile.string(), e.what());
+                    numFailed++;
+                }
+            });
+        }
+        pool.Wait();
+
+        if (numFailed > 0)
+        {
+            throw std::runtime_error(fmt::format("{} of {} RPaks failed to decompress", numFailed.load(), jobs.size()));
         }
 
         logger->info("Decompression complete!");
@@ -182,8 +423,67 @@ struct ExtractParams
     std::string InputDir;
     std::string OutputDir = "extracted";
     std::string RPakName;
+    bool Incremental = false;
+    bool MetadataOnly = false;
+    std::vector<std::string> AssetHashes;
+    std::string SnapshotDir;
+    SlotArenaOptions ArenaOptions;
+    FileReaderOptions ReaderOptions;
 };
 
+// Returns the assets in an earlier extraction that can be reused for this version of the pak, by hash
+std::unordered_map<uint64_t, nlohmann::json> LoadPreviousExtraction(const std::filesystem::path& dbFile, RPakFile& pak, int number, bool dumping, nlohmann::json& assetDB)
+{
+    auto logger = spdlog::get("logger");
+    std::unordered_map<uint64_t, nlohmann::json> previousAssets;
+
+    std::ifstream input(dbFile);
+    if (!input.is_open())
+    {
+        logger->info("No previous extraction found at {}, extracting everything", dbFile.string());
+        return previousAssets;
+    }
+
+    nlohmann::json previousDB;
+    input >> previousDB;
+
+    // Nothing was dumped by a metadata-only run, so there are no files to reuse
+    if (dumping && previousDB.value("metadata_only", false))
+    {
+        logger->info("Previous extraction only wrote metadata, extracting everything");
+        return previousAssets;
+    }
+
+    // The latest patch only says what changed since the newest pak it links to, so the earlier
+    // extraction has to be of exactly that version (or of this one)
+    std::vector<int> linkedNumbers = pak.GetLinkedRPakNumbers();
+    int previousNumber = previousDB.value("number", -1);
+    bool sameVersion = previousNumber == number;
+    if (!sameVersion && (linkedNumbers.empty() || previousNumber != *std::max_element(linkedNumbers.begin(), linkedNumbers.end())))
+    {
+        logger->info("Previous extraction is of version {}, which the latest patch does not build on, extracting everything", previousNumber);
+        return previousAssets;
+    }
+
+    for (const auto& asset : previousDB["assets"])
+    {
+        previousAssets[std::stoull(asset["hash"].get<std::string>(), nullptr, 16)] = asset;
+    }
+
+    // Strings found by dumping the assets that are reused are still needed
+    if (previousDB.contains("strings"))
+    {
+        assetDB["strings"] = previousDB["strings"];
+    }
+
+    if (sameVersion)
+    {
+        logger->info("Previous extraction is of the same version, reusing all of it");
+    }
+
+    return previousAssets;
+}
+
 StarpakReader CreateStarpakReader(const std::string& inputDir, const RPakFile& rpak)
 {
     StarpakReader reader;
@@ -204,6 +504,62 @@ StarpakReader CreateStarpakReader(const std::string& inputDir, const RPakFile& r
     return std::move(reader);
 }
 
+// Fills in the asset's name and, if it can be dumped, dumps it and records where to
+void AddAssetToDB(IAsset& asset, const std::string& outputDir, StarpakReader& starpakReader, bool dump, nlohmann::json& assetInfo, std::unordered_set<std::string>& assetStrings)
+{
+    if (asset.HasEmbeddedName())
+    {
+        assetInfo["name"] = asset.GetEmbeddedName();
+    }
+
+    if (asset.CanDump() && dump)
+    {
+        std::filesystem::path outputFile = outputDir / asset.GetOutputFilePath();
+        std::filesystem::path outputFileDir = outputFile;
+        outputFileDir.remove_filename();
+        std::filesystem::create_directories(outputFileDir);
+        auto thisAssetStrings = asset.Dump(outputFile, starpakReader);
+        assetStrings.merge(thisAssetStrings);
+        assetInfo["dump_path"] = asset.GetOutputFilePath().string();
+    }
+}
+
+// Dumps just the requested assets, reading only the sections they need
+void ExtractSelectedAssets(RPakFile& pak, const ExtractParams& params)
+{
+    auto logger = spdlog::get("logger");
+    StarpakReader starpakReader = CreateStarpakReader(params.InputDir, pak);
+
+    std::vector<std::unique_ptr<IAsset>> assets;
+    for (const auto& hashStr : params.AssetHashes)
+    {
+        std::optional<uint32_t> index = pak.FindAsset(std::stoull(hashStr, nullptr, 16));
+        if (!index)
+        {
+            throw std::runtime_error(fmt::format("Asset {} is not in {}", hashStr, params.RPakName));
+        }
+
+        auto asset = pak.GetAsset(*index);
+        if (!asset || !asset->CanDump())
+        {
+            logger->warn("Asset {} can't be dumped", hashStr);
+            continue;
+        }
+
+        assets.push_back(std::move(asset));
+    }
+
+    for (const auto& asset : assets)
+    {
+        std::filesystem::path outputFile = params.OutputDir / asset->GetOutputFilePath();
+        std::filesystem::path outputFileDir = outputFile;
+        outputFileDir.remove_filename();
+        std::filesystem::create_directories(outputFileDir);
+        asset->Dump(outputFile, starpakReader);
+        logger->info("Dumped {} to {}", Util::HashToString(asset->GetHash()), outputFile.string());
+    }
+}
+
 void AddExtractCommand(CLI::App& app)
 {
     CLI::App* command = app.add_subcommand("extract", "Extract an RPak file");
@@ -215,12 +571,32 @@ void AddExtractCommand(CLI::App& app)
         ->required();
     command->add_option("-o,--outputdir", params->OutputDir, "Path to folder to write extracted files", true);
     command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
+    command->add_flag("--prefetch", params->ReaderOptions.AsyncPrefetch, "Read compressed data on a background thread while decompressing");
+    command->add_flag("--checkpoints", params->ReaderOptions.UseCheckpoints, "Use decoder checkpoints written by decompress --checkpoints to skip through compressed RPaks");
+    command->add_option("--cachedir", params->ReaderOptions.CacheDir, "Folder to keep decompressed copies of RPaks in, so they are only decompressed once");
+    command->add_option("--flatteneddir", params->ReaderOptions.FlattenedDir, "Folder containing RPaks written by flatten, used in place of the originals when present");
+    command->add_flag("--largepages", params->ArenaOptions.LargePages, "Load RPaks into large pages, if the account has the \"Lock pages in memory\" privilege");
+    command->add_flag("--numalocal", params->ArenaOptions.NumaLocal, "Load RPaks into memory on the NUMA node of the thread loading them");
+    command->add_flag("--metadataonly", params->MetadataOnly, "Only load what is needed for asset metadata and write the asset database without dumping anything");
+    command->add_flag("--incremental", params->Incremental, "Only dump assets changed by the latest patch, reusing the rest from an extraction of the previous version in the output folder");
+    command->add_option("--snapshotdir", params->SnapshotDir, "Folder to keep snapshots of fully loaded RPaks in, so later runs can map them instead of loading again");
+    command->add_option("-a,--asset", params->AssetHashes, "Hash of an asset to dump on its own, reading only the sections it needs (can be given more than once). The asset database isn't written.");
     command->add_option("rpak_name", params->RPakName, "Name of RPak file to extract (e.g. sp_training)")
         ->required();
 
     command->callback([params]() {
         auto logger = spdlog::get("logger");
 
+        if (!params->AssetHashes.empty() && (params->Incremental || params->MetadataOnly))
+        {
+            throw std::runtime_error("--asset can't be combined with --incremental or --metadataonly");
+        }
+
+        if (!params->SnapshotDir.empty() && params->Incremental)
+        {
+            throw std::runtime_error("--incremental needs to know what the latest patch changed, which snapshots don't record, so can't be used with --snapshotdir");
+        }
+
         // Check that bindir exists
         logger->debug("TTF2 binary directory: {}", params->BinDir);
         if (!std::filesystem::is_directory(params->BinDir))
@@ -243,11 +619,27 @@ void AddExtractCommand(CLI::App& app)
 
         // Create file opener
         using namespace std::placeholders;
-        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, _1, _2);
+        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, params->ReaderOptions, _1, _2);
 
         // Load the rpak
-        RPakFile pak(params->RPakName, GetLatestRPakNumber(rpakOpener, params->RPakName), rpakOpener);
-        pak.Load();
+        int number = GetLatestRPakNumber(rpakOpener, params->RPakName);
+        RPakFile pak(params->RPakName, number, rpakOpener);
+        pak.SetArenaOptions(params->ArenaOptions);
+
+        if (!params->SnapshotDir.empty())
+        {
+            pak.UseSnapshots(params->SnapshotDir);
+        }
+
+        if (!params->AssetHashes.empty())
+        {
+            pak.Load(RPakLoadMode::OnDemand);
+            ExtractSelectedAssets(pak, *params);
+            logger->info("Extraction complete!");
+            return;
+        }
+
+        pak.Load(params->MetadataOnly ? RPakLoadMode::MetadataOnly : RPakLoadMode::Full);
 
         // Create starpak reader
         StarpakReader starpakReader = CreateStarpakReader(params->InputDir, pak);
@@ -257,8 +649,20 @@ void AddExtractCommand(CLI::App& app)
         json assetDB = json::object();
         json assetList = json::array();
         std::unordered_set<std::string> assetStrings;
+        std::filesystem::path dbFile = std::filesystem::path(params->OutputDir) / (params->RPakName + ".json");
+
+        std::unordered_map<uint64_t, json> previousAssets;
+        if (params->Incremental)
+        {
+            previousAssets = LoadPreviousExtraction(dbFile, pak, number, !params->MetadataOnly, assetDB);
+            if (assetDB.contains("strings"))
+            {
+                assetStrings = assetDB["strings"].get<std::unordered_set<std::string>>();
+            }
+        }
 
         // Iterate over assets and dump ones that can be dumped
+        size_t numReused = 0;
         for (uint32_t i = 0; i < pak.GetNumAssets(); i++)
         {
             json assetInfo;
@@ -266,33 +670,38 @@ void AddExtractCommand(CLI::App& app)
             assetInfo["hash"] = Util::HashToString(assetDef->Hash);
             const char* typeStr = reinterpret_cast<const char*>(&assetDef->Type);
             assetInfo["type"] = std::string(typeStr, strnlen(typeStr, 4));
+            assetInfo["definition"] = Util::HashToString(Util::HashBytes(assetDef, sizeof(AssetDefinition)));
+
+            // Assets that the latest patch didn't touch are already in the output folder. Things like where the
+            // asset's streamed data lives are only in its definition, so that has to be the same too.
+            auto previous = previousAssets.find(assetDef->Hash);
+            if (previous != previousAssets.end() && previous->second["type"] == assetInfo["type"] &&
+                previous->second.value("definition", "") == assetInfo["definition"] && !pak.IsAssetChanged(i))
+            {
+                assetList.push_back(previous->second);
+                numReused++;
+                continue;
+            }
+
             auto asset = pak.GetAsset(i);
             if (asset)
             {
-                if (asset->HasEmbeddedName())
-                {
-                    assetInfo["name"] = asset->GetEmbeddedName();
-                }
-
-                if (asset->CanDump())
-                {
-                    std::filesystem::path outputFile = params->OutputDir / asset->GetOutputFilePath();
-                    std::filesystem::path outputFileDir = outputFile;
-                    outputFileDir.remove_filename();
-                    std::filesystem::create_directories(outputFileDir);
-                    auto thisAssetStrings = asset->Dump(outputFile, starpakReader);
-                    assetStrings.merge(thisAssetStrings);
-                    assetInfo["dump_path"] = asset->GetOutputFilePath().string();
-                }
+                AddAssetToDB(*asset, params->OutputDir, starpakReader, !params->MetadataOnly, assetInfo, assetStrings);
             }
             assetList.push_back(assetInfo);
         }
 
+        if (params->Incremental)
+        {
+            logger->info("Reused {} of {} assets from the previous extraction", numReused, pak.GetNumAssets());
+        }
+
+        assetDB["number"] = number;
+        assetDB["metadata_only"] = params->MetadataOnly;
         assetDB["strings"] = assetStrings;
         assetDB["assets"] = assetList;
 
         // Write out the asset database
-        std::filesystem::path dbFile = std::filesystem::path(params->OutputDir) / (params->RPakName + ".json");
         std::ofstream output(dbFile);
         output << std::setw(2) << assetDB << std::endl;
 
@@ -300,12 +709,77 @@ void AddExtractCommand(CLI::App& app)
     });
 }
 
+struct FlattenParams
+{
+    std::string BinDir;
+    std::string InputDir;
+    std::string OutputDir = "flattened";
+    std::string RPakName;
+    FileReaderOptions ReaderOptions;
+};
+
+void AddFlattenCommand(CLI::App& app)
+{
+    CLI::App* command = app.add_subcommand("flatten", "Apply an RPak's patches and write it out as a single uncompressed RPak");
+
+    auto params = std::make_shared<FlattenParams>();
+    command->add_option("-b,--bindir", params->BinDir, "Path to x64_retail in your Titanfall 2 folder")
+        ->required();
+    command->add_option("-i,--inputdir", params->InputDir, "Path to folder containing rpak files")
+        ->required();
+    command->add_option("-o,--outputdir", params->OutputDir, "Path to folder to write the flattened rpak to (pass this as --flatteneddir to extract)", true);
+    command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
+    command->add_flag("--prefetch", params->ReaderOptions.AsyncPrefetch, "Read compressed data on a background thread while decompressing");
+    command->add_flag("--checkpoints", params->ReaderOptions.UseCheckpoints, "Use decoder checkpoints written by decompress --checkpoints to skip through compressed RPaks");
+    command->add_option("--cachedir", params->ReaderOptions.CacheDir, "Folder to keep decompressed copies of RPaks in, so they are only decompressed once");
+    command->add_option("rpak_name", params->RPakName, "Name of RPak file to flatten (e.g. sp_training)")
+        ->required();
+
+    command->callback([params]() {
+        auto logger = spdlog::get("logger");
+
+        // Check that bindir exists
+        logger->debug("TTF2 binary directory: {}", params->BinDir);
+        if (!std::filesystem::is_directory(params->BinDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --bindir: {} does not exist or is inaccessible", params->BinDir));
+        }
+
+        // Check that inputdir exists
+        logger->debug("RPak directory: {}", params->InputDir);
+        if (!std::filesystem::is_directory(params->InputDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --inputdir: {} does not exist or is inaccessible", params->InputDir));
+        }
+
+        InitializeFupa(params->BinDir);
+
+        // Create file opener
+        using namespace std::placeholders;
+        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, params->ReaderOptions, _1, _2);
+
+        // The flattened pak keeps the number of the latest patch, so it replaces exactly that pak when
+        // extract is given --flatteneddir, and goes stale as soon as a newer patch is installed
+        int number = GetLatestRPakNumber(rpakOpener, params->RPakName);
+        std::filesystem::path outputFile = Util::GetRpakPath(params->OutputDir, params->RPakName, number);
+        std::filesystem::create_directories(outputFile.parent_path());
+
+        RPakFile pak(params->RPakName, number, rpakOpener);
+        pak.Flatten(outputFile.string());
+
+        logger->info("Flattening complete!");
+    });
+}
+
 struct PostProcessParams
 {
     std::string BinDir;
     std::string InputDir;
     std::string OutputDir = "extracted";
     std::string RPakName;
+    std::string SnapshotDir;
+    SlotArenaOptions ArenaOptions;
+    FileReaderOptions ReaderOptions;
 };
 
 std::optional<std::ifstream> DumpedFileReaderFactory(const std::string& outputDir, std::map<uint64_t, std::string>& assetMap, uint64_t hash)
@@ -333,6 +807,13 @@ void AddPostProcessCommand(CLI::App& app)
         ->required();
     command->add_option("-o,--outputdir", params->OutputDir, "Path to folder to read and write post-processed files", true);
     command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
+    command->add_flag("--prefetch", params->ReaderOptions.AsyncPrefetch, "Read compressed data on a background thread while decompressing");
+    command->add_flag("--checkpoints", params->ReaderOptions.UseCheckpoints, "Use decoder checkpoints written by decompress --checkpoints to skip through compressed RPaks");
+    command->add_option("--cachedir", params->ReaderOptions.CacheDir, "Folder to keep decompressed copies of RPaks in, so they are only decompressed once");
+    command->add_option("--flatteneddir", params->ReaderOptions.FlattenedDir, "Folder containing RPaks written by flatten, used in place of the originals when present");
+    command->add_flag("--largepages", params->ArenaOptions.LargePages, "Load RPaks into large pages, if the account has the \"Lock pages in memory\" privilege");
+    command->add_flag("--numalocal", params->ArenaOptions.NumaLocal, "Load RPaks into memory on the NUMA node of the thread loading them");
+    command->add_option("--snapshotdir", params->SnapshotDir, "Folder to keep snapshots of fully loaded RPaks in, so later runs can map them instead of loading again");
     command->add_option("rpak_name", params->RPakName, "Name of RPak file to extract (e.g. sp_training)")
         ->required();
 
@@ -392,10 +873,15 @@ void AddPostProcessCommand(CLI::App& app)
 
         // Create file opener
         using namespace std::placeholders;
-        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, _1, _2);
+        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, params->ReaderOptions, _1, _2);
 
         // Load the rpak
         RPakFile pak(params->RPakName, GetLatestRPakNumber(rpakOpener, params->RPakName), rpakOpener);
+        pak.SetArenaOptions(params->ArenaOptions);
+        if (!params->SnapshotDir.empty())
+        {
+            pak.UseSnapshots(params->SnapshotDir);
+        }
         pak.Load();
 
         // Create starpak reader
@@ -671,6 +1157,532 @@ void AddNamingCommand(CLI::App& app)
     });
 }
 
+struct BenchmarkParams
+{
+    std::string BinDir;
+    std::string InputDir;
+    std::string OutputDir = "benchmark";
+    std::string ResultsFile = "benchmark.json";
+    std::vector<std::string> RPakNames;
+    size_t Iterations = 3;
+    bool Dump = false;
+    bool MetadataOnly = false;
+    SlotArenaOptions ArenaOptions;
+    FileReaderOptions ReaderOptions;
+};
+
+size_t GetPeakMemoryUsage()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+
+    return counters.PeakWorkingSetSize;
+}
+
+// Reads the whole file through the reader in the same sized pieces the decompress command uses
+double TimeFileReader(IDecompressedFileReader& reader)
+{
+    const uint64_t kBufSize = 0x400000;
+    std::unique_ptr<char[]> buf = std::make_unique<char[]>(kBufSize);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t bytesRead = 0;
+    while (bytesRead != reader.GetFileSize())
+    {
+        uint64_t toRead = std::min(reader.GetFileSize() - bytesRead, kBufSize);
+        reader.ReadData(buf.get(), toRead, 0);
+        bytesRead += toRead;
+    }
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+nlohmann::json SummariseTimes(const std::vector<double>& times)
+{
+    nlohmann::json summary;
+    summary["best_seconds"] = *std::min_element(times.begin(), times.end());
+    summary["mean_seconds"] = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+    summary["seconds"] = times;
+    return summary;
+}
+
+nlohmann::json SummariseThroughput(const std::vector<double>& times, uint64_t bytes)
+{
+    nlohmann::json summary = SummariseTimes(times);
+    summary["bytes"] = bytes;
+    summary["mb_per_sec"] = (bytes / (1024.0 * 1024.0)) / summary["best_seconds"].get<double>();
+    return summary;
+}
+
+std::vector<std::string> FindRPakNames(const std::string& inputDir, const std::vector<std::string>& patterns)
+{
+    // Names can be patterns (e.g. mp_*), which are matched against the unpatched paks in the input folder
+    std::vector<std::string> names;
+    for (const auto& pattern : patterns)
+    {
+        if (pattern.find_first_of("*?") == std::string::npos)
+        {
+            names.push_back(pattern);
+            continue;
+        }
+
+        for (auto& entry : std::filesystem::directory_iterator(std::filesystem::path(inputDir) / "paks" / "Win64"))
+        {
+            std::string name = entry.path().stem().string();
+            if (entry.is_regular_file() && entry.path().extension() == ".rpak" && name.find('(') == std::string::npos && Util::WildcardMatch(name, pattern))
+            {
+                names.push_back(name);
+            }
+        }
+    }
+
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+}
+
+nlohmann::json BenchmarkRPak(const BenchmarkParams& params, tRpakOpenerFunc rpakOpener, const std::string& name, int number)
+{
+    using json = nlohmann::json;
+    auto logger = spdlog::get("logger");
+    logger->info("Benchmarking {}", name);
+
+    json result;
+    result["name"] = name;
+    result["number"] = number;
+
+    std::filesystem::path path = Util::GetRpakPath(params.InputDir, name, number);
+    OuterHeader header;
+    std::filesystem::path decompressedPath = path;
+    if (IsCompressedRPak(path, header))
+    {
+        result["compressed_size"] = header.CompressedSize;
+
+        std::vector<double> times;
+        for (size_t i = 0; i < params.Iterations; i++)
+        {
+            CompressedFileReader reader(path.string(), params.ReaderOptions.AsyncPrefetch, params.ReaderOptions.UseCheckpoints);
+            times.push_back(TimeFileReader(reader));
+        }
+        result["compressed_reader"] = SummariseThroughput(times, header.DecompressedSize);
+
+        // PreprocessedFileReader needs a decompressed copy of the file to read
+        decompressedPath = std::filesystem::path(params.OutputDir) / "decompressed" / path.filename();
+        if (!IsDecompressedOutputCurrent(decompressedPath, header))
+        {
+            std::filesystem::create_directories(decompressedPath.parent_path());
+            DecompressFile(path.string(), decompressedPath.string(), DecompressParams());
+        }
+    }
+
+    {
+        std::vector<double> times;
+        uint64_t size = 0;
+        for (size_t i = 0; i < params.Iterations; i++)
+        {
+            PreprocessedFileReader reader(decompressedPath.string());
+            size = reader.GetFileSize();
+            times.push_back(TimeFileReader(reader));
+        }
+        result["decompressed_size"] = size;
+        result["preprocessed_reader"] = SummariseThroughput(times, size);
+    }
+
+    // Full loads, including any linked paks and whatever the reader options say to use
+    std::unique_ptr<RPakFile> pak;
+    std::vector<double> headerTimes, sectionTimes, relocationTimes, totalTimes;
+    for (size_t i = 0; i < params.Iterations; i++)
+    {
+        pak.reset();
+        pak = std::make_unique<RPakFile>(name, number, rpakOpener);
+        pak->SetArenaOptions(params.ArenaOptions);
+        pak->Load(params.MetadataOnly ? RPakLoadMode::MetadataOnly : RPakLoadMode::Full);
+
+        const RPakLoadTimings& timings = pak->GetLoadTimings();
+        headerTimes.push_back(timings.ReadHeader);
+        sectionTimes.push_back(timings.LoadSections);
+        relocationTimes.push_back(timings.ApplyRelocations);
+        totalTimes.push_back(timings.ReadHeader + timings.LoadSections + timings.ApplyRelocations);
+    }
+
+    json load = SummariseTimes(totalTimes);
+    load["read_header"] = SummariseTimes(headerTimes);
+    load["load_sections"] = SummariseTimes(sectionTimes);
+    load["apply_relocations"] = SummariseTimes(relocationTimes);
+    load["num_assets"] = pak->GetNumAssets();
+    load["assets_per_sec"] = pak->GetNumAssets() / load["best_seconds"].get<double>();
+    result["load"] = load;
+
+    // Dumps write lots of files, so they are only timed once
+    if (params.Dump)
+    {
+        StarpakReader starpakReader = CreateStarpakReader(params.InputDir, *pak);
+        std::filesystem::path dumpDir = std::filesystem::path(params.OutputDir) / "dumped" / name;
+
+        std::map<std::string, std::pair<size_t, double>> typeTimes;
+        for (uint32_t i = 0; i < pak->GetNumAssets(); i++)
+        {
+            auto asset = pak->GetAsset(i);
+            if (!asset || !asset->CanDump())
+            {
+                continue;
+            }
+
+            std::filesystem::path outputFile = dumpDir / asset->GetOutputFilePath();
+            std::filesystem::path outputFileDir = outputFile;
+            outputFileDir.remove_filename();
+            std::filesystem::create_directories(outputFileDir);
+
+            auto start = std::chrono::steady_clock::now();
+            asset->Dump(outputFile, starpakReader);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            uint32_t type = asset->GetType();
+            const char* typeStr = reinterpret_cast<const char*>(&type);
+            auto& typeTime = typeTimes[std::string(typeStr, strnlen(typeStr, 4))];
+            typeTime.first++;
+            typeTime.second += seconds;
+        }
+
+        json dump = json::object();
+        for (const auto& [type, typeTime] : typeTimes)
+        {
+            dump[type]["count"] = typeTime.first;
+            dump[type]["seconds"] = typeTime.second;
+            dump[type]["assets_per_sec"] = typeTime.second > 0 ? typeTime.first / typeTime.second : 0.0;
+        }
+        result["dump"] = dump;
+    }
+
+    result["peak_rss_bytes"] = GetPeakMemoryUsage();
+    return result;
+}
+
+// A subcommand rather than its own project, since it has to time the same readers, loader and dumpers the other
+// commands use, and everything they need (rtech_game.dll, D3D, the asset types) is only set up by InitializeFupa
+void AddBenchmarkCommand(CLI::App& app)
+{
+    CLI::App* command = app.add_subcommand("benchmark", "Time decompression, loading and dumping of RPak files and write the results as JSON");
+
+    auto params = std::make_shared<BenchmarkParams>();
+    command->add_option("-b,--bindir", params->BinDir, "Path to x64_retail in your Titanfall 2 folder")
+        ->required();
+    command->add_option("-i,--inputdir", params->InputDir, "Path to folder containing rpak files")
+        ->required();
+    command->add_option("-o,--outputdir", params->OutputDir, "Path to folder for decompressed and dumped files made while benchmarking", true);
+    command->add_option("-r,--results", params->ResultsFile, "Path to write the JSON results to", true);
+    command->add_option("-n,--iterations", params->Iterations, "Number of times to repeat each read and load (the first run may be slower if the files aren't cached by the OS)", true);
+    command->add_flag("--dump", params->Dump, "Also time dumping every asset, grouped by asset type");
+    command->add_flag("--metadataonly", params->MetadataOnly, "Load only what is needed for asset metadata (can't be combined with --dump)");
+    command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
+    command->add_flag("--prefetch", params->ReaderOptions.AsyncPrefetch, "Read compressed data on a background thread while decompressing");
+    command->add_flag("--checkpoints", params->ReaderOptions.UseCheckpoints, "Use decoder checkpoints written by decompress --checkpoints to skip through compressed RPaks");
+    command->add_option("--cachedir", params->ReaderOptions.CacheDir, "Folder to keep decompressed copies of RPaks in, so they are only decompressed once");
+    command->add_option("--flatteneddir", params->ReaderOptions.FlattenedDir, "Folder containing RPaks written by flatten, used in place of the originals when present");
+    command->add_flag("--largepages", params->ArenaOptions.LargePages, "Load RPaks into large pages, if the account has the \"Lock pages in memory\" privilege");
+    command->add_flag("--numalocal", params->ArenaOptions.NumaLocal, "Load RPaks into memory on the NUMA node of the thread loading them");
+    command->add_option("rpak_names", params->RPakNames, "Names of RPak files to benchmark, which may contain wildcards (e.g. sp_training mp_*)")
+        ->required();
+
+    command->callback([params]() {
+        using json = nlohmann::json;
+        auto logger = spdlog::get("logger");
+
+        // Check that bindir exists
+        logger->debug("TTF2 binary directory: {}", params->BinDir);
+        if (!std::filesystem::is_directory(params->BinDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --bindir: {} does not exist or is inaccessible", params->BinDir));
+        }
+
+        // Check that inputdir exists
+        logger->debug("RPak directory: {}", params->InputDir);
+        if (!std::filesystem::is_directory(params->InputDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --inputdir: {} does not exist or is inaccessible", params->InputDir));
+        }
+
+        if (params->Iterations == 0)
+        {
+            throw std::runtime_error("Invalid --iterations: must be at least 1");
+        }
+
+        if (params->Dump && params->MetadataOnly)
+        {
+            throw std::runtime_error("--dump needs asset data, so can't be used with --metadataonly");
+        }
+
+        std::filesystem::create_directories(params->OutputDir);
+
+        InitializeFupa(params->BinDir);
+
+        // Create file opener
+        using namespace std::placeholders;
+        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, params->ReaderOptions, _1, _2);
+
+        std::vector<std::string> names = FindRPakNames(params->InputDir, params->RPakNames);
+        if (names.empty())
+        {
+            throw std::runtime_error("No RPak files matched the given names");
+        }
+
+        auto patchMap = GetPatchRPakMap(rpakOpener);
+
+        json results;
+        results["iterations"] = params->Iterations;
+        results["prefetch"] = params->ReaderOptions.AsyncPrefetch;
+        results["checkpoints"] = params->ReaderOptions.UseCheckpoints;
+        results["cache"] = !params->ReaderOptions.CacheDir.empty();
+        results["flattened"] = !params->ReaderOptions.FlattenedDir.empty();
+        results["metadata_only"] = params->MetadataOnly;
+        results["num_threads"] = std::thread::hardware_concurrency();
+
+        json paks = json::array();
+        for (const auto& name : names)
+        {
+            auto it = patchMap.find(name + ".rpak");
+            int number = it != patchMap.end() ? it->second : 0;
+            paks.push_back(BenchmarkRPak(*params, rpakOpener, name, number));
+        }
+
+        results["paks"] = paks;
+        results["peak_rss_bytes"] = GetPeakMemoryUsage();
+
+        std::ofstream output(params->ResultsFile);
+        output << std::setw(2) << results << std::endl;
+        if (output.fail())
+        {
+            throw std::runtime_error(fmt::format("Failed to write results to {}", params->ResultsFile));
+        }
+
+        logger->info("Benchmark results written to {}", params->ResultsFile);
+    });
+}
+
+struct CatalogueParams
+{
+    std::string BinDir;
+    std::string InputDir;
+    std::string OutputDir = "extracted";
+    std::vector<std::string> RPakNames;
+    size_t NumJobs = std::max(1U, std::thread::hardware_concurrency());
+    FileReaderOptions ReaderOptions;
+    SlotArenaOptions ArenaOptions;
+};
+
+// What the catalogue knows about a pak before anything is dumped
+struct CataloguedRPak
+{
+    std::string Name;
+    int Number = 0;
+    std::vector<std::pair<uint64_t, uint32_t>> Assets; // Hash and type of each asset
+    std::vector<bool> Owned; // Whether each asset is dumped from this pak rather than from another one
+    bool Failed = false; // Couldn't be catalogued, so it doesn't own anything and isn't dumped
+};
+
+void CatalogueRPak(CataloguedRPak& entry, tRpakOpenerFunc rpakOpener)
+{
+    // Only the header is needed to find out which assets the pak has
+    RPakFile pak(entry.Name, entry.Number, rpakOpener);
+    pak.Load(RPakLoadMode::OnDemand);
+    for (uint32_t i = 0; i < pak.GetNumAssets(); i++)
+    {
+        const AssetDefinition* assetDef = pak.GetAssetDefinition(i);
+        entry.Assets.emplace_back(assetDef->Hash, assetDef->Type);
+    }
+}
+
+void DumpCataloguedRPak(const CataloguedRPak& entry, const std::vector<CataloguedRPak>& paks, const std::unordered_map<uint64_t, size_t>& owners,
+    const CatalogueParams& params, tRpakOpenerFunc rpakOpener)
+{
+    using json = nlohmann::json;
+    json assetList = json::array();
+    std::unordered_set<std::string> assetStrings;
+
+    // Paks that don't own any assets don't need loading at all
+    std::unique_ptr<RPakFile> pak;
+    std::optional<StarpakReader> starpakReader;
+    if (std::find(entry.Owned.begin(), entry.Owned.end(), true) != entry.Owned.end())
+    {
+        pak = std::make_unique<RPakFile>(entry.Name, entry.Number, rpakOpener);
+        pak->SetArenaOptions(params.ArenaOptions);
+        pak->Load();
+        starpakReader.emplace(CreateStarpakReader(params.InputDir, *pak));
+    }
+
+    size_t numOwned = 0;
+    for (uint32_t i = 0; i < entry.Assets.size(); i++)
+    {
+        json assetInfo;
+        assetInfo["hash"] = Util::HashToString(entry.Assets[i].first);
+        const char* typeStr = reinterpret_cast<const char*>(&entry.Assets[i].second);
+        assetInfo["type"] = std::string(typeStr, strnlen(typeStr, 4));
+
+        if (!entry.Owned[i])
+        {
+            assetInfo["dumped_by"] = paks[owners.at(entry.Assets[i].first)].Name;
+            assetList.push_back(assetInfo);
+            continue;
+        }
+
+        auto asset = pak->GetAsset(i);
+        if (asset)
+        {
+            AddAssetToDB(*asset, params.OutputDir, *starpakReader, true, assetInfo, assetStrings);
+        }
+        assetList.push_back(assetInfo);
+        numOwned++;
+    }
+
+    json assetDB = json::object();
+    assetDB["number"] = entry.Number;
+    assetDB["strings"] = assetStrings;
+    assetDB["assets"] = assetList;
+
+    std::filesystem::path dbFile = std::filesystem::path(params.OutputDir) / (entry.Name + ".json");
+    std::ofstream output(dbFile);
+    output << std::setw(2) << assetDB << std::endl;
+    if (output.fail())
+    {
+        throw std::runtime_error(fmt::format("Failed to write asset database {}", dbFile.string()));
+    }
+
+    spdlog::get("logger")->info("Extracted {} ({} of {} assets, the rest are dumped from other paks)", entry.Name, numOwned, entry.Assets.size());
+}
+
+void AddCatalogueCommand(CLI::App& app)
+{
+    CLI::App* command = app.add_subcommand("catalogue", "Extract a set of RPak files together, dumping assets that are in more than one of them only once");
+
+    auto params = std::make_shared<CatalogueParams>();
+    command->add_option("-b,--bindir", params->BinDir, "Path to x64_retail in your Titanfall 2 folder")
+        ->required();
+    command->add_option("-i,--inputdir", params->InputDir, "Path to folder containing rpak files")
+        ->required();
+    command->add_option("-o,--outputdir", params->OutputDir, "Path to folder to write extracted files", true);
+    command->add_option("-j,--jobs", params->NumJobs, "Number of RPaks to load at once", true);
+    command->add_flag("-v", VerbosityCallback, "Verbose output (-vv for very verbose)");
+    command->add_flag("--prefetch", params->ReaderOptions.AsyncPrefetch, "Read compressed data on a background thread while decompressing");
+    command->add_flag("--checkpoints", params->ReaderOptions.UseCheckpoints, "Use decoder checkpoints written by decompress --checkpoints to skip through compressed RPaks");
+    command->add_option("--cachedir", params->ReaderOptions.CacheDir, "Folder to keep decompressed copies of RPaks in, so they are only decompressed once");
+    command->add_option("--flatteneddir", params->ReaderOptions.FlattenedDir, "Folder containing RPaks written by flatten, used in place of the originals when present");
+    command->add_flag("--largepages", params->ArenaOptions.LargePages, "Load RPaks into large pages, if the account has the \"Lock pages in memory\" privilege");
+    command->add_flag("--numalocal", params->ArenaOptions.NumaLocal, "Load RPaks into memory on the NUMA node of the thread loading them");
+    command->add_option("rpak_names", params->RPakNames, "Names of RPak files to extract, which may contain wildcards (e.g. sp_training mp_*)")
+        ->required();
+
+    command->callback([params]() {
+        auto logger = spdlog::get("logger");
+
+        // Check that bindir exists
+        logger->debug("TTF2 binary directory: {}", params->BinDir);
+        if (!std::filesystem::is_directory(params->BinDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --bindir: {} does not exist or is inaccessible", params->BinDir));
+        }
+
+        // Check that inputdir exists
+        logger->debug("RPak directory: {}", params->InputDir);
+        if (!std::filesystem::is_directory(params->InputDir))
+        {
+            throw std::runtime_error(fmt::format("Invalid --inputdir: {} does not exist or is inaccessible", params->InputDir));
+        }
+
+        // Create outputdir if it doesn't already exist
+        logger->debug("Output directory: {}", params->OutputDir);
+        std::filesystem::create_directories(params->OutputDir);
+
+        InitializeFupa(params->BinDir);
+
+        // Create file opener
+        using namespace std::placeholders;
+        auto rpakOpener = std::bind(FileReaderFactory, params->InputDir, params->ReaderOptions, _1, _2);
+
+        std::vector<std::string> names = FindRPakNames(params->InputDir, params->RPakNames);
+        if (names.empty())
+        {
+            throw std::runtime_error("No RPak files matched the given names");
+        }
+
+        auto patchMap = GetPatchRPakMap(rpakOpener);
+        std::vector<CataloguedRPak> paks(names.size());
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            auto it = patchMap.find(names[i] + ".rpak");
+            paks[i].Name = names[i];
+            paks[i].Number = it != patchMap.end() ? it->second : 0;
+        }
+
+        // Find out which assets each pak has
+        logger->info("Cataloguing {} RPaks using {} threads", paks.size(), params->NumJobs);
+        std::atomic<size_t> numFailed = 0;
+        ThreadPool pool(std::max<size_t>(1, params->NumJobs));
+        for (auto& entry : paks)
+        {
+            pool.Submit([&entry, rpakOpener, &numFailed]() {
+                try
+                {
+                    CatalogueRPak(entry, rpakOpener);
+                }
+                catch (const std::exception& e)
+                {
+                    spdlog::get("logger")->error("Failed to catalogue {}: {}", entry.Name, e.what());
+                    entry.Assets.clear();
+                    entry.Failed = true;
+                    numFailed++;
+                }
+            });
+        }
+        pool.Wait();
+
+        // Each asset is dumped from the first pak (by name) that has it. Paks that couldn't be catalogued have no
+        // assets, so anything they share with the others is dumped from whichever of those comes first.
+        std::unordered_map<uint64_t, size_t> owners;
+        size_t numAssets = 0;
+        for (size_t i = 0; i < paks.size(); i++)
+        {
+            paks[i].Owned.resize(paks[i].Assets.size());
+            for (size_t j = 0; j < paks[i].Assets.size(); j++)
+            {
+                paks[i].Owned[j] = owners.emplace(paks[i].Assets[j].first, i).second;
+            }
+            numAssets += paks[i].Assets.size();
+        }
+        logger->info("Found {} unique assets out of {} across all RPaks", owners.size(), numAssets);
+
+        for (const auto& entry : paks)
+        {
+            if (entry.Failed)
+            {
+                continue;
+            }
+
+            pool.Submit([&entry, &paks, &owners, params, rpakOpener, &numFailed]() {
+                try
+                {
+                    DumpCataloguedRPak(entry, paks, owners, *params, rpakOpener);
+                }
+                catch (const std::exception& e)
+                {
+                    spdlog::get("logger")->error("Failed to extract {}: {}", entry.Name, e.what());
+                    numFailed++;
+                }
+            });
+        }
+        pool.Wait();
+
+        if (numFailed > 0)
+        {
+            throw std::runtime_error(fmt::format("{} of {} RPaks failed to extract", numFailed.load(), paks.size()));
+        }
+
+        logger->info("Extraction complete!");
+    });
+}
+
 void InitializeLogger()
 {
     std::vector<spdlog::sink_ptr> sinks;
@@ -689,8 +1701,11 @@ int main(int argc, char** argv)
     app.require_subcommand(1, 1);
     AddDecompressCommand(app);
     AddExtractCommand(app);
+    AddFlattenCommand(app);
     AddPostProcessCommand(app);
     AddNamingCommand(app);
+    AddBenchmarkCommand(app);
+    AddCatalogueCommand(app);
 
     try
     {
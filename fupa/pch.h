@@ -6,6 +6,7 @@
 
 #include <string>
 #include <Windows.h>
+#include <Psapi.h>
 #undef min
 #undef max
 #include <fmt/format.h>
@@ -17,6 +18,15 @@
 #include <unordered_set>
 #include <spdlog/spdlog.h>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <optional>
+#include <future>
 #include <d3d11.h>
 #include <DirectXTex.h>
 #include <Windows.Foundation.h>
@@ -26,12 +36,17 @@
 #include "d3d.h"
 #include "CLI11.hpp"
 #include "rtech.h"
+#include "StarpakFile.h"
+#include "StarpakRegistry.h"
 #include "StarpakReader.h"
 #include "IAsset.h"
 #include "common/common_types.h"
 #include "ttf2/ttf2_types.h"
 #include "apex/apex_types.h"
 #include "Util.h"
+#include "ThreadPool.h"
+#include "ScratchBufferPool.h"
+#include "SlotArena.h"
 #include "IDecompressedFileReader.h"
 #include "CompressedFileReader.h"
 #include "AssetFactory.h"
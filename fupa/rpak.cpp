@@ -1,42 +1,505 @@
 #include "pch.h"
 
-const char kPatchArray1Values[] = { 0, 1, 2, 3, 4, 5, 6 };
-const char kPatchArray2Values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
 const uint64_t kSpecialPatchAmounts[] = { 3, 7, 6 };
 
-size_t(RPakFile::*(RPakFile::PatchFunctions)[])(char* buffer, size_t bytesToRead) = {
-    &RPakFile::PatchFuncRead,
-    &RPakFile::PatchFuncSkip,
-    &RPakFile::PatchFuncInsert,
-    &RPakFile::PatchFuncReplace,
-    &RPakFile::PatchFuncReplaceOneThenRead,
-    &RPakFile::PatchFuncReplaceOneThenRead,
-    &RPakFile::PatchFuncReplaceTwoThenRead
-};
+const uint32_t kSnapshotSignature = 0x504E5346; // FSNP
+const uint32_t kSnapshotVersion = 1;
+const uint64_t kSnapshotChunkSize = 0x400000; // Slots are written out this much at a time
+const uint64_t kSnapshotAlignment = 0x10000; // Views are mapped at this granularity, so slots stay as aligned as they are in the file
+const uint64_t kNoSnapshotOffset = ~0ull;
+
+const uint32_t kNoAssetIndex = ~0u;
+const uint32_t kUnresolvedSection = ~0u; // Marks relocations whose target hasn't been read
 
 RPakFile::RPakFile(std::string name, int pakNumber, tRpakOpenerFunc rpakOpener) :
     m_reader(std::move(rpakOpener(name, pakNumber))),
     m_name(name),
-    m_rpakOpener(rpakOpener)
+    m_pakNumber(pakNumber),
+    m_rpakOpener(rpakOpener),
+    m_startingSectionOffset(0),
+    m_currentPatchCommand(0),
+    m_patchCommandOffset(0),
+    m_loadMode(RPakLoadMode::Full),
+    m_patchedPosition(0),
+    m_snapshotFile(INVALID_HANDLE_VALUE),
+    m_snapshotMapping(nullptr),
+    m_snapshotView(nullptr),
+    m_assetIndexShift(64),
+    m_loadingSection(-1)
 {
     m_logger = spdlog::get("logger");
 }
 
 RPakFile::~RPakFile()
 {
-    for (uint32_t i = 0; i < kNumSlots; i++)
+    CloseSnapshot();
+}
+
+void RPakFile::Load(RPakLoadMode mode)
+{
+    m_logger->info("Loading {}", m_name);
+    m_loadMode = mode;
+    auto start = std::chrono::steady_clock::now();
+    ReadOuterHeader();
+    if (m_loadMode == RPakLoadMode::Full && !m_snapshotDir.empty() && LoadSnapshot())
+    {
+        m_loadTimings.ReadHeader = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        m_logger->debug("Loaded {} from snapshot in {:.3f}s", m_name, m_loadTimings.ReadHeader);
+        return;
+    }
+
+    ReadHeader();
+    auto headerRead = std::chrono::steady_clock::now();
+    if (m_loadMode == RPakLoadMode::OnDemand)
+    {
+        PrepareOnDemandSections();
+    }
+    else
+    {
+        LoadSections();
+    }
+    auto sectionsLoaded = std::chrono::steady_clock::now();
+    if (m_loadMode != RPakLoadMode::OnDemand)
+    {
+        ApplyRelocations();
+    }
+    auto relocationsApplied = std::chrono::steady_clock::now();
+
+    m_loadTimings.ReadHeader = std::chrono::duration<double>(headerRead - start).count();
+    m_loadTimings.LoadSections = std::chrono::duration<double>(sectionsLoaded - headerRead).count();
+    m_loadTimings.ApplyRelocations = std::chrono::duration<double>(relocationsApplied - sectionsLoaded).count();
+    m_logger->debug("Loaded {} in {:.3f}s (header {:.3f}s, sections {:.3f}s, relocations {:.3f}s)", m_name,
+        m_loadTimings.ReadHeader + m_loadTimings.LoadSections + m_loadTimings.ApplyRelocations,
+        m_loadTimings.ReadHeader, m_loadTimings.LoadSections, m_loadTimings.ApplyRelocations);
+
+    if (m_loadMode == RPakLoadMode::Full && !m_snapshotDir.empty())
     {
-        _aligned_free(m_slotData[i]);
-        m_slotData[i] = nullptr;
+        SaveSnapshot();
     }
 }
 
-void RPakFile::Load()
+void RPakFile::Flatten(const std::string& outputFile)
 {
-    m_logger->info("Loading {}", m_name);
+    // Relocations are deliberately not applied, so the sections are written out exactly as they
+    // would have been read from a pak without any links
+    m_logger->info("Flattening {}", m_name);
+    ReadOuterHeader();
     ReadHeader();
     LoadSections();
-    ApplyRelocations();
+
+    std::string tempFile = outputFile + ".tmp";
+    std::ofstream output(tempFile, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!output.is_open())
+    {
+        throw std::runtime_error(fmt::format("Failed to open {}", tempFile));
+    }
+
+    // The header is written again once the final size is known
+    OuterHeader header = m_outerHeader;
+    output.write(reinterpret_cast<char*>(&header), sizeof(header));
+
+    WriteStarpakBlock(output, m_starpakPaths, m_outerHeader.StarpakPathBlockSize);
+#ifdef APEX
+    WriteStarpakBlock(output, m_fullStarpakPaths, m_outerHeader.FullStarpakPathBlockSize);
+#endif
+
+    size_t extraHeaderSize = GetExtraHeaderSize();
+    output.write(reinterpret_cast<char*>(m_slotDescriptors.get()), sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors);
+    output.write(reinterpret_cast<char*>(m_sectionDescriptors.get()), sizeof(SectionDescriptor) * m_outerHeader.NumSections);
+    output.write(reinterpret_cast<char*>(m_relocationDescriptors.get()), sizeof(SectionReference) * m_outerHeader.NumRelocations);
+    output.write(reinterpret_cast<char*>(m_assetDefinitions.get()), sizeof(AssetDefinition) * m_outerHeader.NumAssets);
+    output.write(m_extraHeader.get(), extraHeaderSize);
+
+    // Without links the sections are stored in order, starting from the first one
+    for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        if (m_sectionDescriptors[i].Size > 0)
+        {
+            output.write(m_sectionPointers[i], m_sectionDescriptors[i].Size);
+        }
+    }
+
+    uint64_t size = output.tellp();
+    header.Flags &= ~0x100;
+    header.CompressedSize = size;
+    header.DecompressedSize = size;
+    header.NumRPakLinks = 0;
+    output.seekp(0, std::ios::beg);
+    output.write(reinterpret_cast<char*>(&header), sizeof(header));
+    output.close();
+    if (output.fail())
+    {
+        throw std::runtime_error(fmt::format("Failed to write {}", tempFile));
+    }
+
+    std::filesystem::rename(tempFile, outputFile);
+    m_logger->info("Wrote 0x{:x} bytes to {}", size, outputFile);
+}
+
+void RPakFile::WriteStarpakBlock(std::ofstream& output, const std::vector<std::string>& paths, size_t blockSize)
+{
+    std::vector<char> block(blockSize, 0);
+    size_t offset = 0;
+    for (const auto& path : paths)
+    {
+        if (offset + path.size() + 1 > blockSize)
+        {
+            throw std::runtime_error(fmt::format("Starpak paths do not fit in block of 0x{:x} bytes", blockSize));
+        }
+
+        memcpy(block.data() + offset, path.c_str(), path.size() + 1);
+        offset += path.size() + 1;
+    }
+
+    output.write(block.data(), blockSize);
+}
+
+void RPakFile::SetArenaOptions(const SlotArenaOptions& options)
+{
+    m_arenaOptions = options;
+}
+
+void RPakFile::UseSnapshots(const std::string& snapshotDir)
+{
+    m_snapshotDir = snapshotDir;
+}
+
+std::filesystem::path RPakFile::GetSnapshotPath()
+{
+    return std::filesystem::path(m_snapshotDir) / (Util::GetRpakPath("", m_name, m_pakNumber).filename().string() + ".snapshot");
+}
+
+bool RPakFile::LoadSnapshot()
+{
+    std::string path = GetSnapshotPath().string();
+    m_snapshotFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_snapshotFile == INVALID_HANDLE_VALUE)
+    {
+        m_logger->debug("No snapshot of {} at {}", m_name, path);
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_snapshotFile, &fileSize) || static_cast<uint64_t>(fileSize.QuadPart) < sizeof(SnapshotHeader))
+    {
+        m_logger->warn("Snapshot {} is truncated, loading normally", path);
+        CloseSnapshot();
+        return false;
+    }
+
+    // Copy-on-write, so pages only get copied once a pointer in them is rebased
+    m_snapshotMapping = CreateFileMappingA(m_snapshotFile, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (m_snapshotMapping != nullptr)
+    {
+        m_snapshotView = static_cast<char*>(MapViewOfFile(m_snapshotMapping, FILE_MAP_COPY, 0, 0, 0));
+    }
+
+    if (m_snapshotView == nullptr)
+    {
+        m_logger->warn("Failed to map snapshot {} (error {}), loading normally", path, GetLastError());
+        CloseSnapshot();
+        return false;
+    }
+
+    // The snapshot is only current if it was made from exactly the same latest pak. Flattened paks have a different
+    // header to the paks they were made from, so switching between them just means the snapshot gets made again.
+    const SnapshotHeader& header = *reinterpret_cast<const SnapshotHeader*>(m_snapshotView);
+    if (header.Signature != kSnapshotSignature || header.Version != kSnapshotVersion || header.PakNumber != m_pakNumber ||
+        memcmp(&header.PakHeader, &m_outerHeader, sizeof(OuterHeader)) != 0)
+    {
+        m_logger->info("Snapshot of {} is out of date, loading normally", m_name);
+        CloseSnapshot();
+        return false;
+    }
+
+    try
+    {
+        // Everything the snapshot points at has to be inside one of its slots, and the slots inside the file
+        uint64_t mappingSize = static_cast<uint64_t>(fileSize.QuadPart);
+        for (uint32_t i = 0; i < kNumSlots; i++)
+        {
+            if (header.SlotOffsets[i] > mappingSize || header.SlotSizes[i] > mappingSize - header.SlotOffsets[i])
+            {
+                throw std::runtime_error(fmt::format("Slot {} runs past the end of the file", i));
+            }
+        }
+
+        // Pointers can be to the very end of a slot, the same as when they're saved
+        auto isInSlot = [&header](uint64_t start, uint64_t size) {
+            for (uint32_t i = 0; i < kNumSlots; i++)
+            {
+                if (header.SlotSizes[i] != 0 && start >= header.SlotOffsets[i] && size <= header.SlotSizes[i] &&
+                    start - header.SlotOffsets[i] <= header.SlotSizes[i] - size)
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        uint64_t offset = sizeof(SnapshotHeader);
+        auto readBlock = [&](uint64_t size) {
+            if (size > mappingSize - offset)
+            {
+                throw std::runtime_error("Header data runs past the end of the file");
+            }
+            const char* block = m_snapshotView + offset;
+            offset += size;
+            return block;
+        };
+
+        if (m_outerHeader.NumRPakLinks != 0)
+        {
+            m_linkedRPakSizes = std::make_unique<LinkedRPakSize[]>(m_outerHeader.NumRPakLinks);
+            memcpy(m_linkedRPakSizes.get(), readBlock(sizeof(LinkedRPakSize) * m_outerHeader.NumRPakLinks), sizeof(LinkedRPakSize) * m_outerHeader.NumRPakLinks);
+            m_linkedRPakNumbers = std::make_unique<uint16_t[]>(m_outerHeader.NumRPakLinks);
+            memcpy(m_linkedRPakNumbers.get(), readBlock(sizeof(uint16_t) * m_outerHeader.NumRPakLinks), sizeof(uint16_t) * m_outerHeader.NumRPakLinks);
+        }
+
+        if (m_outerHeader.StarpakPathBlockSize != 0)
+        {
+            m_starpakPaths = ParseStarpakBlock(readBlock(m_outerHeader.StarpakPathBlockSize), m_outerHeader.StarpakPathBlockSize);
+        }
+
+#ifdef APEX
+        if (m_outerHeader.FullStarpakPathBlockSize != 0)
+        {
+            m_fullStarpakPaths = ParseStarpakBlock(readBlock(m_outerHeader.FullStarpakPathBlockSize), m_outerHeader.FullStarpakPathBlockSize);
+        }
+#endif
+
+        m_slotDescriptors = std::make_unique<SlotDescriptor[]>(m_outerHeader.NumSlotDescriptors);
+        memcpy(m_slotDescriptors.get(), readBlock(sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors), sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors);
+
+        m_sectionDescriptors = std::make_unique<SectionDescriptor[]>(m_outerHeader.NumSections);
+        memcpy(m_sectionDescriptors.get(), readBlock(sizeof(SectionDescriptor) * m_outerHeader.NumSections), sizeof(SectionDescriptor) * m_outerHeader.NumSections);
+
+        const uint64_t* sectionOffsets = reinterpret_cast<const uint64_t*>(readBlock(sizeof(uint64_t) * m_outerHeader.NumSections));
+
+        m_relocationDescriptors = std::make_unique<SectionReference[]>(m_outerHeader.NumRelocations);
+        memcpy(m_relocationDescriptors.get(), readBlock(sizeof(SectionReference) * m_outerHeader.NumRelocations), sizeof(SectionReference) * m_outerHeader.NumRelocations);
+
+        m_assetDefinitions = std::make_unique<AssetDefinition[]>(m_outerHeader.NumAssets);
+        memcpy(m_assetDefinitions.get(), readBlock(sizeof(AssetDefinition) * m_outerHeader.NumAssets), sizeof(AssetDefinition) * m_outerHeader.NumAssets);
+        BuildAssetIndex();
+
+        m_extraHeader = std::make_unique<char[]>(GetExtraHeaderSize());
+        memcpy(m_extraHeader.get(), readBlock(GetExtraHeaderSize()), GetExtraHeaderSize());
+
+        m_sectionPointers = std::make_unique<char*[]>(m_outerHeader.NumSections);
+        for (uint16_t i = 0; i < m_outerHeader.NumSections; i++)
+        {
+            if (sectionOffsets[i] == kNoSnapshotOffset)
+            {
+                m_sectionPointers[i] = nullptr;
+                continue;
+            }
+
+            if (!isInSlot(sectionOffsets[i], m_sectionDescriptors[i].Size))
+            {
+                throw std::runtime_error(fmt::format("Section {} is not inside any of the slots", i));
+            }
+            m_sectionPointers[i] = m_snapshotView + sectionOffsets[i];
+        }
+
+        // Turn the stored offsets back into pointers
+        for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
+        {
+            SectionReference& relocLoc = m_relocationDescriptors[i];
+            if (!IsReferenceValid(relocLoc) || m_sectionPointers[relocLoc.Section] == nullptr ||
+                m_sectionDescriptors[relocLoc.Section].Size - relocLoc.Offset < sizeof(void*))
+            {
+                throw std::runtime_error(fmt::format("Relocation {} is invalid: offset 0x{:x} in section {}", i, relocLoc.Offset, relocLoc.Section));
+            }
+
+            char** location = reinterpret_cast<char**>(m_sectionPointers[relocLoc.Section] + relocLoc.Offset);
+            uint64_t target = *reinterpret_cast<uint64_t*>(location);
+            if (!isInSlot(target, 0))
+            {
+                throw std::runtime_error(fmt::format("Relocation {} points outside of the slots", i));
+            }
+            *location = m_snapshotView + target;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        m_logger->warn("Snapshot {} is invalid ({}), loading normally", path, e.what());
+        CloseSnapshot();
+        return false;
+    }
+
+    m_logger->info("Loaded {} from snapshot {}", m_name, path);
+    return true;
+}
+
+void RPakFile::SaveSnapshot()
+{
+    std::filesystem::path path = GetSnapshotPath();
+    std::filesystem::create_directories(path.parent_path());
+    std::string tempFile = path.string() + ".tmp";
+    std::ofstream output(tempFile, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!output.is_open())
+    {
+        m_logger->warn("Failed to open {}, not saving a snapshot of {}", tempFile, m_name);
+        return;
+    }
+
+    SnapshotHeader header = {};
+    header.Signature = kSnapshotSignature;
+    header.Version = kSnapshotVersion;
+    header.PakHeader = m_outerHeader;
+    header.PakNumber = m_pakNumber;
+
+    // Lay out the slots after everything else
+    uint64_t headerSize = sizeof(SnapshotHeader) + ((sizeof(LinkedRPakSize) + sizeof(uint16_t)) * m_outerHeader.NumRPakLinks) + m_outerHeader.StarpakPathBlockSize +
+        (sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors) + ((sizeof(SectionDescriptor) + sizeof(uint64_t)) * m_outerHeader.NumSections) +
+        (sizeof(SectionReference) * m_outerHeader.NumRelocations) + (sizeof(AssetDefinition) * m_outerHeader.NumAssets) + GetExtraHeaderSize();
+#ifdef APEX
+    headerSize += m_outerHeader.FullStarpakPathBlockSize;
+#endif
+
+    uint64_t offset = (headerSize + kSnapshotAlignment - 1) & ~(kSnapshotAlignment - 1);
+    for (uint32_t i = 0; i < kNumSlots; i++)
+    {
+        if (m_slotData[i] != nullptr)
+        {
+            header.SlotOffsets[i] = offset;
+            header.SlotSizes[i] = m_slotSizes[i];
+            offset = (offset + m_slotSizes[i] + kSnapshotAlignment - 1) & ~(kSnapshotAlignment - 1);
+        }
+    }
+
+    std::vector<uint64_t> sectionOffsets(m_outerHeader.NumSections, kNoSnapshotOffset);
+    for (uint16_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        if (m_sectionPointers[i] != nullptr)
+        {
+            sectionOffsets[i] = GetSnapshotOffset(m_sectionPointers[i], header);
+        }
+    }
+
+    output.write(reinterpret_cast<char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<char*>(m_linkedRPakSizes.get()), sizeof(LinkedRPakSize) * m_outerHeader.NumRPakLinks);
+    output.write(reinterpret_cast<char*>(m_linkedRPakNumbers.get()), sizeof(uint16_t) * m_outerHeader.NumRPakLinks);
+    WriteStarpakBlock(output, m_starpakPaths, m_outerHeader.StarpakPathBlockSize);
+#ifdef APEX
+    WriteStarpakBlock(output, m_fullStarpakPaths, m_outerHeader.FullStarpakPathBlockSize);
+#endif
+    output.write(reinterpret_cast<char*>(m_slotDescriptors.get()), sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors);
+    output.write(reinterpret_cast<char*>(m_sectionDescriptors.get()), sizeof(SectionDescriptor) * m_outerHeader.NumSections);
+    output.write(reinterpret_cast<char*>(sectionOffsets.data()), sizeof(uint64_t) * m_outerHeader.NumSections);
+    output.write(reinterpret_cast<char*>(m_relocationDescriptors.get()), sizeof(SectionReference) * m_outerHeader.NumRelocations);
+    output.write(reinterpret_cast<char*>(m_assetDefinitions.get()), sizeof(AssetDefinition) * m_outerHeader.NumAssets);
+    output.write(m_extraHeader.get(), GetExtraHeaderSize());
+
+    // Relocated pointers are written as offsets into the file, without touching the loaded pak. Each slot is
+    // copied out a chunk at a time with the pointers in that chunk swapped for offsets, so the only extra
+    // memory needed is one chunk and the list of pointers.
+    std::vector<std::pair<uint64_t, uint64_t>> slotPointers[kNumSlots];
+    for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
+    {
+        SectionReference& relocLoc = m_relocationDescriptors[i];
+        uint32_t slot = m_slotDescriptors[m_sectionDescriptors[relocLoc.Section].SlotDescIndex].Slot & (kNumSlots - 1);
+        char* location = m_sectionPointers[relocLoc.Section] + relocLoc.Offset;
+        slotPointers[slot].emplace_back(location - m_slotData[slot], GetSnapshotOffset(*reinterpret_cast<char**>(location), header));
+    }
+
+    std::vector<char> chunk;
+    for (uint32_t i = 0; i < kNumSlots; i++)
+    {
+        if (m_slotData[i] == nullptr)
+        {
+            continue;
+        }
+
+        std::vector<char> padding(header.SlotOffsets[i] - output.tellp(), 0);
+        output.write(padding.data(), padding.size());
+
+        auto& pointers = slotPointers[i];
+        std::sort(pointers.begin(), pointers.end());
+        size_t nextPointer = 0;
+        uint64_t chunkStart = 0;
+        while (chunkStart < m_slotSizes[i])
+        {
+            // A pointer that starts in this chunk is written whole, even if that runs a few bytes past the end of it
+            uint64_t chunkEnd = std::min(m_slotSizes[i], chunkStart + kSnapshotChunkSize);
+            size_t endPointer = nextPointer;
+            while (endPointer < pointers.size() && pointers[endPointer].first < chunkEnd)
+            {
+                chunkEnd = std::max(chunkEnd, pointers[endPointer].first + sizeof(uint64_t));
+                endPointer++;
+            }
+
+            chunk.assign(m_slotData[i] + chunkStart, m_slotData[i] + chunkEnd);
+            for (; nextPointer < endPointer; nextPointer++)
+            {
+                memcpy(chunk.data() + (pointers[nextPointer].first - chunkStart), &pointers[nextPointer].second, sizeof(uint64_t));
+            }
+
+            output.write(chunk.data(), chunk.size());
+            chunkStart = chunkEnd;
+        }
+    }
+
+    if (output.fail())
+    {
+        m_logger->warn("Failed to write snapshot {}", tempFile);
+        output.close();
+        std::filesystem::remove(tempFile);
+        return;
+    }
+    output.close();
+
+    std::error_code error;
+    std::filesystem::rename(tempFile, path, error);
+    if (error)
+    {
+        m_logger->warn("Failed to move snapshot into place at {}: {}", path.string(), error.message());
+        std::filesystem::remove(tempFile, error);
+        return;
+    }
+
+    m_logger->info("Saved snapshot of {} to {}", m_name, path.string());
+}
+
+void RPakFile::CloseSnapshot()
+{
+    if (m_snapshotView != nullptr)
+    {
+        UnmapViewOfFile(m_snapshotView);
+        m_snapshotView = nullptr;
+    }
+
+    if (m_snapshotMapping != nullptr)
+    {
+        CloseHandle(m_snapshotMapping);
+        m_snapshotMapping = nullptr;
+    }
+
+    if (m_snapshotFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_snapshotFile);
+        m_snapshotFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+uint64_t RPakFile::GetSnapshotOffset(const char* pointer, const SnapshotHeader& header)
+{
+    // Pointers can be to the very end of a slot, e.g. for empty arrays at the end of a section
+    for (uint32_t i = 0; i < kNumSlots; i++)
+    {
+        if (m_slotData[i] != nullptr && pointer >= m_slotData[i] && pointer <= m_slotData[i] + m_slotSizes[i])
+        {
+            return header.SlotOffsets[i] + (pointer - m_slotData[i]);
+        }
+    }
+
+    throw std::runtime_error(fmt::format("Pointer {} is not in any of the slots", static_cast<const void*>(pointer)));
+}
+
+size_t RPakFile::GetExtraHeaderSize() const
+{
+    return (m_outerHeader.NumExtraHeader8Bytes * 8) + (m_outerHeader.NumExtraHeader4Bytes1 * 4) + (m_outerHeader.NumExtraHeader4Bytes2 * 4) + m_outerHeader.NumExtraHeader1Bytes;
 }
 
 uint32_t RPakFile::GetNumAssets()
@@ -55,6 +518,153 @@ const AssetDefinition* RPakFile::GetAssetDefinition(uint32_t index)
     return &m_assetDefinitions[index];
 }
 
+std::optional<uint32_t> RPakFile::FindAsset(uint64_t hash) const
+{
+    if (m_assetIndex.empty())
+    {
+        return {};
+    }
+
+    size_t mask = m_assetIndex.size() - 1;
+    for (size_t bucket = GetAssetIndexBucket(hash); m_assetIndex[bucket].Index != kNoAssetIndex; bucket = (bucket + 1) & mask)
+    {
+        if (m_assetIndex[bucket].Hash == hash)
+        {
+            return m_assetIndex[bucket].Index;
+        }
+    }
+
+    return {};
+}
+
+void RPakFile::BuildAssetIndex()
+{
+    // Kept at most half full so probe sequences stay short
+    size_t capacity = 1;
+    m_assetIndexShift = 64;
+    while (capacity < static_cast<size_t>(m_outerHeader.NumAssets) * 2)
+    {
+        capacity *= 2;
+        m_assetIndexShift--;
+    }
+
+    m_assetIndex.assign(capacity, { 0, kNoAssetIndex });
+    size_t mask = capacity - 1;
+    for (uint32_t i = 0; i < m_outerHeader.NumAssets; i++)
+    {
+        uint64_t hash = m_assetDefinitions[i].Hash;
+        size_t bucket = GetAssetIndexBucket(hash);
+        while (m_assetIndex[bucket].Index != kNoAssetIndex && m_assetIndex[bucket].Hash != hash)
+        {
+            bucket = (bucket + 1) & mask;
+        }
+
+        // If a hash is used more than once, the first asset with it wins
+        if (m_assetIndex[bucket].Index != kNoAssetIndex)
+        {
+            m_logger->debug("Assets {} and {} have the same hash {:x}", m_assetIndex[bucket].Index, i, hash);
+            continue;
+        }
+
+        m_assetIndex[bucket] = { hash, i };
+    }
+}
+
+size_t RPakFile::GetAssetIndexBucket(uint64_t hash) const
+{
+    // Fibonacci hashing, so every bit of the asset hash affects which bucket it goes in
+    return m_assetIndexShift < 64 ? static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> m_assetIndexShift) : 0;
+}
+
+bool RPakFile::IsAssetChanged(uint32_t index)
+{
+    if (index >= m_outerHeader.NumAssets)
+    {
+        throw std::runtime_error(fmt::format("Index {} is out range of assets ({})", index, m_outerHeader.NumAssets));
+    }
+
+    if (m_loadMode == RPakLoadMode::OnDemand)
+    {
+        throw std::runtime_error("Changes can't be tracked when loading sections on demand");
+    }
+
+    if (m_snapshotView != nullptr)
+    {
+        throw std::runtime_error("Changes can't be tracked when loaded from a snapshot");
+    }
+
+    // Without any links everything comes straight from this file
+    if (m_outerHeader.NumRPakLinks == 0)
+    {
+        return true;
+    }
+
+    if (m_objectStarts.empty())
+    {
+        BuildChangeIndex();
+    }
+
+    AssetDefinition& asset = m_assetDefinitions[index];
+    if (!IsReferenceValid(asset.MetadataRef))
+    {
+        return true;
+    }
+
+    // Anything the asset points at (names, arrays of sub-structures, etc.) is part of it too, and so is
+    // anything those point at, so follow every pointer until there's nothing new left to look at
+    std::vector<std::pair<SectionReference, uint64_t>> pending;
+    std::set<std::pair<uint32_t, uint64_t>> visited;
+    pending.emplace_back(asset.MetadataRef, asset.MetadataRef.Offset + asset.MetadataSize);
+    if (IsReferenceValid(asset.DataRef))
+    {
+        pending.emplace_back(asset.DataRef, GetObjectEnd(asset.DataRef.Section, asset.DataRef.Offset));
+    }
+
+    while (!pending.empty())
+    {
+        auto [start, end] = pending.back();
+        pending.pop_back();
+        if (!visited.emplace(start.Section, start.Offset).second)
+        {
+            continue;
+        }
+
+        if (IsRangeChanged(start.Section, start.Offset, end))
+        {
+            return true;
+        }
+
+        auto it = std::lower_bound(m_relocationsByLocation.begin(), m_relocationsByLocation.end(), start, [this](uint32_t reloc, const SectionReference& ref) {
+            const SectionReference& loc = m_relocationDescriptors[reloc];
+            return loc.Section < ref.Section || (loc.Section == ref.Section && loc.Offset < ref.Offset);
+        });
+        for (; it != m_relocationsByLocation.end(); ++it)
+        {
+            const SectionReference& loc = m_relocationDescriptors[*it];
+            if (loc.Section != start.Section || loc.Offset >= end)
+            {
+                break;
+            }
+
+            // If the pointer was never resolved (e.g. its section was skipped) there's no telling what it covers
+            SectionReference target = m_relocationTargets[*it];
+            if (!IsReferenceValid(target))
+            {
+                return true;
+            }
+
+            pending.emplace_back(target, GetObjectEnd(target.Section, target.Offset));
+        }
+    }
+
+    return false;
+}
+
+std::vector<int> RPakFile::GetLinkedRPakNumbers() const
+{
+    return std::vector<int>(m_linkedRPakNumbers.get(), m_linkedRPakNumbers.get() + m_outerHeader.NumRPakLinks);
+}
+
 std::unique_ptr<IAsset> RPakFile::GetAsset(uint32_t index)
 {
     if (index >= m_outerHeader.NumAssets)
@@ -70,8 +680,24 @@ std::unique_ptr<IAsset> RPakFile::GetAsset(uint32_t index)
         return nullptr;
     }
 
+    if (m_loadMode == RPakLoadMode::OnDemand)
+    {
+        std::vector<uint32_t> sections = { asset->MetadataRef.Section };
+        if (IsReferenceValid(asset->DataRef))
+        {
+            sections.push_back(asset->DataRef.Section);
+        }
+        LoadSectionsOnDemand(sections);
+    }
+
+    if (m_sectionPointers[asset->MetadataRef.Section] == nullptr)
+    {
+        m_logger->error("Metadata for asset {} was not loaded, returning null asset", index);
+        return nullptr;
+    }
+
     const uint8_t* metadata = reinterpret_cast<uint8_t*>(m_sectionPointers[asset->MetadataRef.Section] + asset->MetadataRef.Offset);
-    const uint8_t* data = IsReferenceValid(asset->DataRef) ? reinterpret_cast<uint8_t*>(m_sectionPointers[asset->DataRef.Section] + asset->DataRef.Offset) : nullptr;
+    const uint8_t* data = IsReferenceValid(asset->DataRef) && m_sectionPointers[asset->DataRef.Section] != nullptr ? reinterpret_cast<uint8_t*>(m_sectionPointers[asset->DataRef.Section] + asset->DataRef.Offset) : nullptr;
     auto result = AssetFactory::Create(const_cast<const AssetDefinition*>(asset), metadata, data);
     if (!result)
     {
@@ -87,6 +713,11 @@ const std::vector<std::string>& RPakFile::GetStarpakPaths() const
     return m_starpakPaths;
 }
 
+const RPakLoadTimings& RPakFile::GetLoadTimings() const
+{
+    return m_loadTimings;
+}
+
 #ifdef APEX
 const std::vector<std::string>& RPakFile::GetFullStarpakPaths() const
 {
@@ -94,9 +725,8 @@ const std::vector<std::string>& RPakFile::GetFullStarpakPaths() const
 }
 #endif
 
-void RPakFile::ReadHeader()
+void RPakFile::ReadOuterHeader()
 {
-    // Read the outer header
     m_logger->debug("Reading outer header");
     m_reader.ReadData(reinterpret_cast<char*>(&m_outerHeader), sizeof(m_outerHeader));
 
@@ -109,7 +739,10 @@ void RPakFile::ReadHeader()
     {
         throw std::runtime_error(fmt::format("Version {} does not match expected version {}", m_outerHeader.Version, kExpectedVersion));
     }
+}
 
+void RPakFile::ReadHeader()
+{
     // Print out the header values
     m_logger->debug("====== Outer Header ======");
     m_logger->debug("Flags: 0x{:x}", m_outerHeader.Flags);
@@ -128,8 +761,13 @@ void RPakFile::ReadHeader()
     m_logger->debug("NumExtraHeader4Bytes2: {}", m_outerHeader.NumExtraHeader4Bytes2);
     m_logger->debug("NumExtraHeader1Bytes: {}", m_outerHeader.NumExtraHeader1Bytes);
 
-    m_bytesUntilNextPatch = m_outerHeader.DecompressedSize - sizeof(OuterHeader) + (m_outerHeader.NumRPakLinks != 0 ? 0 : 1);
-    m_patchInstruction = &RPakFile::PatchFuncRead;
+    // Everything in the base file is read as-is, and the patch commands only start once it has all been read.
+    // Without links there are no patch commands, so the read is made 1 byte longer to never finish.
+    m_patchCommands.clear();
+    m_patchCommands.push_back({ kPatchCommandRead, m_outerHeader.DecompressedSize - sizeof(OuterHeader) + (m_outerHeader.NumRPakLinks != 0 ? 0 : 1), 0 });
+    m_currentPatchCommand = 0;
+    m_patchCommandOffset = 0;
+    m_patchedPosition = 0;
 
     // Read data on links to other RPaks
     if (m_outerHeader.NumRPakLinks != 0)
@@ -150,9 +788,10 @@ void RPakFile::ReadHeader()
         m_logger->debug("====== RPak Links ======");
         for (uint16_t i = 0; i < m_outerHeader.NumRPakLinks; i++)
         {
-            m_reader.PushFile(m_rpakOpener(m_name, m_linkedRPakNumbers[i]), true);
             m_logger->debug("{}: Size: 0x{:x}, Decompressed Size: 0x{:x}, Number: {}", i, m_linkedRPakSizes[i].SizeOnDisk, m_linkedRPakSizes[i].DecompressedSize, m_linkedRPakNumbers[i]);
         }
+
+        PushLinkedRPaks();
     }
 
     // Read starpak paths
@@ -193,7 +832,7 @@ void RPakFile::ReadHeader()
     ReadPatchedData(reinterpret_cast<char*>(m_slotDescriptors.get()), sizeof(SlotDescriptor) * m_outerHeader.NumSlotDescriptors);
 
     // Calculate sizes, offsets, and alignments
-    uint64_t slotSizes[kNumSlots] = {};
+    std::fill(std::begin(m_slotSizes), std::end(m_slotSizes), 0);
     uint64_t slotDescOffsets[32] = {}; // TODO: Probably should make this dynamically allocated
     uint32_t slotAlignments[kNumSlots] = {};
     for (uint16_t i = 0; i < m_outerHeader.NumSlotDescriptors; i++)
@@ -202,10 +841,10 @@ void RPakFile::ReadHeader()
         uint32_t slotNum = slotDesc.Slot & 3; // TODO: This will need to be updated if total slots changes
         slotAlignments[slotNum] = std::max(slotAlignments[slotNum], slotDesc.Alignment);
 
-        uint64_t offset = (slotSizes[slotNum] + slotDesc.Alignment - 1) & ~static_cast<uint64_t>(slotDesc.Alignment - 1);
+        uint64_t offset = (m_slotSizes[slotNum] + slotDesc.Alignment - 1) & ~static_cast<uint64_t>(slotDesc.Alignment - 1);
         slotDescOffsets[i] = offset;
 
-        slotSizes[slotNum] = offset + slotDesc.Size;
+        m_slotSizes[slotNum] = offset + slotDesc.Size;
 
         m_logger->debug("{}: SlotNum: {}, Alignment: 0x{:x}, Size: 0x{:x}, Offset: 0x{:x}", i, slotNum, slotDesc.Alignment, slotDesc.Size, offset);
     }
@@ -213,20 +852,24 @@ void RPakFile::ReadHeader()
     m_logger->debug("====== Slot Totals ======");
     for (uint32_t i = 0; i < kNumSlots; i++)
     {
-        m_logger->debug("{}: Size: 0x{:x}, Alignment: 0x{:x}", i, slotSizes[i], slotAlignments[i]);
+        m_logger->debug("{}: Size: 0x{:x}, Alignment: 0x{:x}", i, m_slotSizes[i], slotAlignments[i]);
     }
 
-    // Allocate memory for slot data
+    // All the slots go in one arena. Full loads commit it all now, and other load modes commit each section as it is read.
+    uint64_t slotArenaOffsets[kNumSlots] = {};
+    uint64_t arenaSize = 0;
     for (uint32_t i = 0; i < kNumSlots; i++)
     {
-        if (slotSizes[i] > 0)
-        {
-            m_slotData[i] = static_cast<char*>(_aligned_malloc(slotSizes[i], slotAlignments[i]));
-        }
-        else
-        {
-            m_slotData[i] = nullptr;
-        }
+        uint64_t alignment = std::max<uint32_t>(slotAlignments[i], 1);
+        slotArenaOffsets[i] = (arenaSize + alignment - 1) & ~(alignment - 1);
+        arenaSize = slotArenaOffsets[i] + m_slotSizes[i];
+    }
+
+    bool commitArena = m_loadMode == RPakLoadMode::Full;
+    m_slotArena.Reserve(arenaSize, commitArena, m_arenaOptions);
+    for (uint32_t i = 0; i < kNumSlots; i++)
+    {
+        m_slotData[i] = m_slotSizes[i] > 0 && commitArena ? m_slotArena.GetData() + slotArenaOffsets[i] : nullptr;
     }
 
     // Read section information and make array of pointers to each of them
@@ -237,12 +880,17 @@ void RPakFile::ReadHeader()
     ReadPatchedData(reinterpret_cast<char*>(m_sectionDescriptors.get()), sizeof(SectionDescriptor) * m_outerHeader.NumSections);
 
     m_sectionPointers = std::make_unique<char*[]>(m_outerHeader.NumSections);
+    m_sectionArenaOffsets.assign(m_outerHeader.NumSections, 0);
+    m_changedRanges.clear();
+    m_changedRanges.resize(m_outerHeader.NumSections);
 
     for (uint16_t i = 0; i < m_outerHeader.NumSections; i++)
     {
         SectionDescriptor& sectDesc = m_sectionDescriptors[i];
         uint64_t offset = (slotDescOffsets[sectDesc.SlotDescIndex] + sectDesc.Alignment - 1) & ~static_cast<uint64_t>(sectDesc.Alignment - 1);
-        m_sectionPointers[i] = m_slotData[m_slotDescriptors[sectDesc.SlotDescIndex].Slot & 3] + offset; // TODO: This will need to be updated if total slots changes
+        uint32_t slotNum = m_slotDescriptors[sectDesc.SlotDescIndex].Slot & 3; // TODO: This will need to be updated if total slots changes
+        m_sectionArenaOffsets[i] = slotArenaOffsets[slotNum] + offset;
+        m_sectionPointers[i] = m_slotData[slotNum] != nullptr ? m_slotData[slotNum] + offset : nullptr;
         slotDescOffsets[sectDesc.SlotDescIndex] = offset + sectDesc.Size;
         m_logger->debug("{}: SlotDescIdx: {}, Alignment: 0x{:x}, Size: 0x{:x}, Offset: 0x{:x}, Data: {}", i, sectDesc.SlotDescIndex, sectDesc.Alignment, sectDesc.Size, offset, static_cast<void*>(m_sectionPointers[i]));
     }
@@ -253,6 +901,11 @@ void RPakFile::ReadHeader()
 
     m_relocationDescriptors = std::make_unique<SectionReference[]>(m_outerHeader.NumRelocations);
     ReadPatchedData(reinterpret_cast<char*>(m_relocationDescriptors.get()), sizeof(SectionReference) * m_outerHeader.NumRelocations);
+    if (m_outerHeader.NumRPakLinks != 0)
+    {
+        m_relocationTargets = std::make_unique<SectionReference[]>(m_outerHeader.NumRelocations);
+        std::fill_n(m_relocationTargets.get(), m_outerHeader.NumRelocations, SectionReference{ kUnresolvedSection, 0 });
+    }
 
     for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
     {
@@ -266,6 +919,8 @@ void RPakFile::ReadHeader()
 
     m_assetDefinitions = std::make_unique<AssetDefinition[]>(m_outerHeader.NumAssets);
     ReadPatchedData(reinterpret_cast<char*>(m_assetDefinitions.get()), sizeof(AssetDefinition) * m_outerHeader.NumAssets);
+    BuildAssetIndex();
+
     std::unordered_map<uint32_t, int> assetCounts;
     for (uint32_t i = 0; i < m_outerHeader.NumAssets; i++)
     {
@@ -283,7 +938,7 @@ void RPakFile::ReadHeader()
 
     // Read extra header
     m_logger->debug("====== Extra Header ======");
-    size_t extraHeaderSize = (m_outerHeader.NumExtraHeader8Bytes * 8) + (m_outerHeader.NumExtraHeader4Bytes1 * 4) + (m_outerHeader.NumExtraHeader4Bytes2 * 4) + m_outerHeader.NumExtraHeader1Bytes;
+    size_t extraHeaderSize = GetExtraHeaderSize();
     m_logger->debug("Size: 0x{:x}", extraHeaderSize);
 
     m_extraHeader = std::make_unique<char[]>(extraHeaderSize);
@@ -299,30 +954,352 @@ void RPakFile::ReadHeader()
         ReadPatchedData(reinterpret_cast<char*>(m_patchDataBlock.get()), m_patchDataBlockSize);
 
         // Construct patch data arrays
-        uint8_t* nextBlock = m_patchDataBlock.get() + rtech::ConstructPatchArray(m_patchDataBlock.get(), 6, kPatchArray1Values, m_patchData1, m_patchData2);
-        nextBlock += rtech::ConstructPatchArray(nextBlock, 8, kPatchArray2Values, m_patchData3, m_patchData4);
+        size_t tablesSize = rtech::BuildPatchTables(m_patchDataBlock.get(), &m_patchTables);
+        uint8_t* nextBlock = m_patchDataBlock.get() + tablesSize;
+
         uint64_t val = *reinterpret_cast<uint64_t*>(nextBlock);
 
-        // Set the initial patch variables
-        m_patch704 = 24;
-        m_patch696 = val >> 24;
-        m_patch680 = reinterpret_cast<uint64_t*>(nextBlock) + 1;
-        m_currentPatchData = nextBlock + (val & 0xFFFFFF);
+        // Only the sections are left to read, so decode exactly as many commands as it takes to produce them
+        uint64_t sectionsSize = 0;
+        for (uint16_t i = 0; i < m_outerHeader.NumSections; i++)
+        {
+            sectionsSize += m_sectionDescriptors[i].Size;
+        }
+
+        uint64_t baseBytesRemaining = m_patchCommands[m_currentPatchCommand].Length - m_patchCommandOffset;
+        uint64_t dataOffset = (nextBlock - m_patchDataBlock.get()) + (val & 0xFFFFFF);
+        DecodePatchCommands(nextBlock, dataOffset, sectionsSize > baseBytesRemaining ? sectionsSize - baseBytesRemaining : 0);
     }
 }
 
 void RPakFile::LoadSections()
 {
+    std::vector<bool> sectionNeeded(m_outerHeader.NumSections, true);
+    std::vector<std::vector<uint32_t>> sectionRelocations;
+    if (m_loadMode == RPakLoadMode::MetadataOnly)
+    {
+        sectionNeeded = FindMetadataSections();
+        sectionRelocations.resize(m_outerHeader.NumSections);
+        for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
+        {
+            if (m_relocationDescriptors[i].Section < m_outerHeader.NumSections)
+            {
+                sectionRelocations[m_relocationDescriptors[i].Section].push_back(i);
+            }
+        }
+    }
+
     // Sectors are stored sequentially after the header information, so just read them in order
+    uint64_t sectionDataStart = m_patchedPosition;
+    for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        int32_t section = NormalizeSection(i);
+        SectionDescriptor& sectDesc = m_sectionDescriptors[section];
+        if (sectDesc.Size == 0)
+        {
+            continue;
+        }
+
+        m_loadingSection = section;
+        if (!sectionNeeded[section])
+        {
+            m_logger->debug("Skipping section {} (0x{:x} bytes)", section, sectDesc.Size);
+            ReadPatchedData(nullptr, sectDesc.Size);
+            m_loadingSection = -1;
+            continue;
+        }
+
+        m_logger->debug("Reading section {} (0x{:x} bytes)", section, sectDesc.Size);
+        ReadPatchedData(AllocateSection(section), sectDesc.Size);
+        m_loadingSection = -1;
+
+        // Anything this section points to has to be loaded too. Sections that have already gone by are
+        // picked up afterwards by LoadSkippedSections.
+        if (m_loadMode == RPakLoadMode::MetadataOnly)
+        {
+            for (uint32_t reloc : sectionRelocations[section])
+            {
+                SectionReference& relocLoc = m_relocationDescriptors[reloc];
+                if (IsReferenceValid(relocLoc))
+                {
+                    SectionReference* ref = reinterpret_cast<SectionReference*>(m_sectionPointers[section] + relocLoc.Offset);
+                    if (ref->Section < m_outerHeader.NumSections)
+                    {
+                        sectionNeeded[ref->Section] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    if (m_loadMode == RPakLoadMode::MetadataOnly)
+    {
+        LoadSkippedSections(sectionNeeded, sectionRelocations, sectionDataStart);
+    }
+
+    if (m_outerHeader.NumRPakLinks != 0)
+    {
+        size_t numRanges = 0;
+        for (const auto& ranges : m_changedRanges)
+        {
+            numRanges += ranges.size();
+        }
+        m_logger->debug("Latest patch changed {} ranges of section data", numRanges);
+    }
+}
+
+void RPakFile::PushLinkedRPaks()
+{
+    for (uint16_t i = 0; i < m_outerHeader.NumRPakLinks; i++)
+    {
+        // Linked paks are only opened when the patch commands actually need data from them
+        int number = m_linkedRPakNumbers[i];
+        std::string fileName = Util::GetRpakPath("", m_name, number).filename().string();
+        m_reader.PushDeferredFile(fileName, m_linkedRPakSizes[i].DecompressedSize, [this, number]() { return m_rpakOpener(m_name, number); }, true);
+    }
+}
+
+void RPakFile::LoadSkippedSections(std::vector<bool>& sectionNeeded, const std::vector<std::vector<uint32_t>>& sectionRelocations, uint64_t sectionDataStart)
+{
+    // Sections that something points back to were skipped before anything said they were needed, and
+    // the only way back to them is to start the patched data again. Whatever they point to is needed too.
+    std::vector<uint32_t> sections;
+    for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        if (sectionNeeded[i] && m_sectionPointers[i] == nullptr && m_sectionDescriptors[i].Size > 0)
+        {
+            sections.push_back(i);
+        }
+    }
+
+    if (sections.empty())
+    {
+        return;
+    }
+
+    m_logger->debug("{} skipped sections turned out to be needed", sections.size());
+    SetSectionStreamOffsets(sectionDataStart);
+    m_sectionLoaded.resize(m_outerHeader.NumSections);
+    for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        m_sectionLoaded[i] = m_sectionPointers[i] != nullptr;
+    }
+
+    while (!sections.empty())
+    {
+        std::sort(sections.begin(), sections.end(), [this](uint32_t a, uint32_t b) {
+            return m_sectionStreamOffsets[a] < m_sectionStreamOffsets[b];
+        });
+        sections.erase(std::unique(sections.begin(), sections.end()), sections.end());
+
+        std::vector<uint32_t> targets;
+        for (uint32_t section : sections)
+        {
+            if (m_sectionLoaded[section])
+            {
+                continue;
+            }
+
+            ReadSectionFromStream(section);
+            for (uint32_t reloc : sectionRelocations[section])
+            {
+                SectionReference& relocLoc = m_relocationDescriptors[reloc];
+                if (IsReferenceValid(relocLoc))
+                {
+                    SectionReference* ref = reinterpret_cast<SectionReference*>(m_sectionPointers[section] + relocLoc.Offset);
+                    if (ref->Section < m_outerHeader.NumSections && !m_sectionLoaded[ref->Section])
+                    {
+                        sectionNeeded[ref->Section] = true;
+                        targets.push_back(ref->Section);
+                    }
+                }
+            }
+        }
+
+        sections = std::move(targets);
+    }
+}
+
+void RPakFile::SetSectionStreamOffsets(uint64_t sectionDataStart)
+{
+    // The sections follow each other in order, starting at sectionDataStart in the patched data
+    m_sectionStreamOffsets.resize(m_outerHeader.NumSections);
+    uint64_t offset = sectionDataStart;
     for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
     {
         int32_t section = NormalizeSection(i);
-        if (m_sectionDescriptors[section].Size > 0)
+        m_sectionStreamOffsets[section] = offset;
+        offset += m_sectionDescriptors[section].Size;
+    }
+}
+
+void RPakFile::PrepareOnDemandSections()
+{
+    // The reader is now at the start of the section data
+    SetSectionStreamOffsets(m_patchedPosition);
+    m_sectionLoaded.assign(m_outerHeader.NumSections, false);
+    m_sectionRelocations.assign(m_outerHeader.NumSections, {});
+    for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
+    {
+        SectionReference& relocLoc = m_relocationDescriptors[i];
+        if (!IsReferenceValid(relocLoc))
+        {
+            throw std::runtime_error(fmt::format("Relocation descriptor {} is invalid: offset 0x{:x} in section {}", i, relocLoc.Offset, relocLoc.Section));
+        }
+        m_sectionRelocations[relocLoc.Section].push_back(i);
+    }
+
+    if (m_outerHeader.NumRPakLinks != 0)
+    {
+        m_relocationTargets = std::make_unique<SectionReference[]>(m_outerHeader.NumRelocations);
+        std::fill_n(m_relocationTargets.get(), m_outerHeader.NumRelocations, SectionReference{ kUnresolvedSection, 0 });
+    }
+}
+
+void RPakFile::LoadSectionsOnDemand(std::vector<uint32_t> sections)
+{
+    // Loads the sections along with everything they point to. Each round reads the sections in the order
+    // they are stored, so the data only has to be rewound (at most) once per round.
+    while (!sections.empty())
+    {
+        std::sort(sections.begin(), sections.end(), [this](uint32_t a, uint32_t b) {
+            return m_sectionStreamOffsets[a] < m_sectionStreamOffsets[b];
+        });
+        sections.erase(std::unique(sections.begin(), sections.end()), sections.end());
+
+        std::vector<uint32_t> targets;
+        for (uint32_t section : sections)
+        {
+            if (m_sectionLoaded[section])
+            {
+                continue;
+            }
+
+            ReadSectionFromStream(section);
+            for (uint32_t reloc : m_sectionRelocations[section])
+            {
+                targets.push_back(ApplyRelocation(reloc));
+            }
+        }
+
+        sections.clear();
+        for (uint32_t target : targets)
+        {
+            if (!m_sectionLoaded[target])
+            {
+                sections.push_back(target);
+            }
+        }
+    }
+}
+
+void RPakFile::ReadSectionFromStream(uint32_t section)
+{
+    SectionDescriptor& sectDesc = m_sectionDescriptors[section];
+    uint64_t offset = m_sectionStreamOffsets[section];
+    if (m_patchedPosition > offset)
+    {
+        RewindPatchedData();
+    }
+
+    ReadPatchedData(nullptr, offset - m_patchedPosition);
+
+    // Track changes the same as the first pass does. The section may already have been gone over while it
+    // was being skipped, so start its ranges again rather than adding the same ones twice.
+    m_logger->debug("Reading section {} (0x{:x} bytes) on demand", section, sectDesc.Size);
+    m_changedRanges[section].clear();
+    m_loadingSection = section;
+    ReadPatchedData(AllocateSection(section), sectDesc.Size);
+    m_loadingSection = -1;
+    m_sectionLoaded[section] = true;
+}
+
+void RPakFile::RewindPatchedData()
+{
+    // Patch commands can only be followed forwards, so start again from the beginning of the base file
+    m_logger->debug("Rewinding {} to read an earlier section", m_name);
+    m_reader = ChainedReader(m_rpakOpener(m_name, m_pakNumber));
+    m_reader.ReadData(nullptr, 0, sizeof(OuterHeader));
+    PushLinkedRPaks();
+
+    m_currentPatchCommand = 0;
+    m_patchCommandOffset = 0;
+    m_patchedPosition = 0;
+}
+
+char* RPakFile::AllocateSection(uint32_t section)
+{
+    if (m_sectionPointers[section] == nullptr && m_sectionDescriptors[section].Size > 0)
+    {
+        m_sectionPointers[section] = m_slotArena.Commit(m_sectionArenaOffsets[section], m_sectionDescriptors[section].Size);
+    }
+
+    return m_sectionPointers[section];
+}
+
+uint32_t RPakFile::ApplyRelocation(uint32_t index)
+{
+    // Like ApplyRelocations, but for a single relocation in a section that has just been read. The section it
+    // points to is allocated straight away so the pointer can be written, but it's up to the caller to read it.
+    SectionReference& relocLoc = m_relocationDescriptors[index];
+    SectionReference* ref = reinterpret_cast<SectionReference*>(m_sectionPointers[relocLoc.Section] + relocLoc.Offset);
+    if (!IsReferenceValid(*ref))
+    {
+        throw std::runtime_error(fmt::format("Relocation {}'s inner reference is invalid: offset 0x{:x} in section {}", index, ref->Offset, ref->Section));
+    }
+
+    SectionReference target = *ref;
+    if (m_relocationTargets)
+    {
+        m_relocationTargets[index] = target;
+    }
+
+    *reinterpret_cast<char**>(ref) = AllocateSection(target.Section) + target.Offset;
+    return target.Section;
+}
+
+std::vector<bool> RPakFile::FindMetadataSections()
+{
+    // Sections that are only ever referred to as asset data hold things like texture and model data, which
+    // never contain pointers. Everything else might be needed to read the metadata, so it is kept.
+    std::vector<bool> dataOnly(m_outerHeader.NumSections, false);
+    for (uint32_t i = 0; i < m_outerHeader.NumAssets; i++)
+    {
+        if (IsReferenceValid(m_assetDefinitions[i].DataRef))
+        {
+            dataOnly[m_assetDefinitions[i].DataRef.Section] = true;
+        }
+    }
+
+    for (uint32_t i = 0; i < m_outerHeader.NumAssets; i++)
+    {
+        if (IsReferenceValid(m_assetDefinitions[i].MetadataRef))
+        {
+            dataOnly[m_assetDefinitions[i].MetadataRef.Section] = false;
+        }
+    }
+
+    for (uint32_t i = 0; i < m_outerHeader.NumRelocations; i++)
+    {
+        if (m_relocationDescriptors[i].Section < m_outerHeader.NumSections)
         {
-            m_logger->debug("Reading section {} (0x{:x} bytes)", section, m_sectionDescriptors[section].Size);
-            ReadPatchedData(m_sectionPointers[section], m_sectionDescriptors[section].Size);
+            dataOnly[m_relocationDescriptors[i].Section] = false;
         }
     }
+
+    std::vector<bool> needed(m_outerHeader.NumSections);
+    uint64_t skippedSize = 0;
+    for (uint32_t i = 0; i < m_outerHeader.NumSections; i++)
+    {
+        needed[i] = !dataOnly[i];
+        if (dataOnly[i])
+        {
+            skippedSize += m_sectionDescriptors[i].Size;
+        }
+    }
+
+    m_logger->debug("Skipping 0x{:x} bytes of data-only sections", skippedSize);
+    return needed;
 }
 
 void RPakFile::ApplyRelocations()
@@ -338,6 +1315,11 @@ void RPakFile::ApplyRelocations()
             throw std::runtime_error(fmt::format("Relocation descriptor {} is invalid: offset 0x{:x} in section {}", i, relocLoc.Offset, relocLoc.Section));
         }
 
+        if (m_sectionPointers[relocLoc.Section] == nullptr)
+        {
+            continue;
+        }
+
         // Get the reference at the location referenced by the relocation entry
         SectionReference* ref = reinterpret_cast<SectionReference*>(m_sectionPointers[relocLoc.Section] + relocLoc.Offset);
         if (!IsReferenceValid(*ref))
@@ -345,7 +1327,18 @@ void RPakFile::ApplyRelocations()
             throw std::runtime_error(fmt::format("Relocation {}'s inner reference is invalid: offset 0x{:x} in section {}", i, ref->Offset, ref->Section));
         }
 
-        // Update the reference data to be a real pointer
+        if (m_relocationTargets)
+        {
+            m_relocationTargets[i] = *ref;
+        }
+
+        // Everything a loaded section points to is loaded along with it, so a missing target means the pak
+        // can't be used - better to stop here than hand out null pointers for assets to trip over later
+        if (m_sectionPointers[ref->Section] == nullptr)
+        {
+            throw std::runtime_error(fmt::format("Relocation {} points into section {}, which wasn't loaded", i, ref->Section));
+        }
+
         *reinterpret_cast<char**>(ref) = m_sectionPointers[ref->Section] + ref->Offset;
     }
 }
@@ -377,21 +1370,73 @@ std::vector<std::string> RPakFile::ParseStarpakBlock(const char* data, size_t bl
     return starpakPaths;
 }
 
+// If buffer is null, the data is skipped rather than read
 void RPakFile::ReadPatchedData(char* buffer, size_t bytesToRead)
 {
     size_t bytesRead = 0;
     while (bytesRead != bytesToRead)
     {
-        if (m_bytesUntilNextPatch > 0)
+        if (m_currentPatchCommand >= m_patchCommands.size())
         {
-            size_t read = (*this.*m_patchInstruction)(buffer + bytesRead, bytesToRead - bytesRead);
-            bytesRead += read;
+            throw std::runtime_error("Ran out of patch commands before all data was read");
         }
-        else
+
+        const PatchCommand& command = m_patchCommands[m_currentPatchCommand];
+        uint64_t commandBytesRemaining = command.Length - m_patchCommandOffset;
+        uint64_t amount = std::min<uint64_t>(commandBytesRemaining, bytesToRead - bytesRead);
+        switch (command.Type)
+        {
+        case kPatchCommandRead:
+            if (buffer != nullptr)
+            {
+                m_reader.ReadData(buffer + bytesRead, amount);
+            }
+            else
+            {
+                m_reader.ReadData(nullptr, 0, amount);
+            }
+            if (m_currentPatchCommand == 0)
+            {
+                MarkChanged(bytesRead, amount);
+            }
+            bytesRead += amount;
+            break;
+
+        case kPatchCommandSkip:
+            // Skips don't produce any output, so the whole thing can always be done at once
+            amount = commandBytesRemaining;
+            m_reader.ReadData(nullptr, 0, amount);
+            break;
+
+        case kPatchCommandInsert:
+            if (buffer != nullptr)
+            {
+                memcpy(buffer + bytesRead, m_patchDataBlock.get() + command.DataOffset + m_patchCommandOffset, amount);
+            }
+            MarkChanged(bytesRead, amount);
+            bytesRead += amount;
+            break;
+
+        case kPatchCommandReplace:
+            if (buffer != nullptr)
+            {
+                memcpy(buffer + bytesRead, m_patchDataBlock.get() + command.DataOffset + m_patchCommandOffset, amount);
+            }
+            m_reader.ReadData(nullptr, 0, amount);
+            MarkChanged(bytesRead, amount);
+            bytesRead += amount;
+            break;
+        }
+
+        m_patchCommandOffset += amount;
+        if (m_patchCommandOffset == command.Length)
         {
-            UpdatePatchInstruction();
+            m_currentPatchCommand++;
+            m_patchCommandOffset = 0;
         }
     }
+
+    m_patchedPosition += bytesToRead;
 }
 
 int32_t RPakFile::NormalizeSection(uint32_t section)
@@ -404,140 +1449,164 @@ int32_t RPakFile::NormalizeSection(uint32_t section)
     return val;
 }
 
-void RPakFile::UpdatePatchInstruction()
+void RPakFile::DecodePatchCommands(const uint8_t* patchStream, uint64_t dataOffset, uint64_t outputSize)
 {
-    m_patch696 |= *m_patch680 << (64 - static_cast<uint8_t>(m_patch704));
-    m_patch680 = reinterpret_cast<uint64_t*>(reinterpret_cast<uint8_t*>(m_patch680) + (m_patch704 >> 3));
-    m_patch704 = m_patch704 & 7;
+    // The opcode stream is a bitstream of Huffman-style codes. The first 24 bits of the initial qword
+    // are the offset of the patch data, so decoding starts just after them.
+    uint64_t bits = *reinterpret_cast<const uint64_t*>(patchStream) >> 24;
+    uint32_t bitPosition = 24;
+    const uint8_t* stream = patchStream + sizeof(uint64_t);
+
+    size_t numOpcodes = 0;
+    uint64_t bytesOutput = 0;
+    while (bytesOutput < outputSize)
+    {
+        bits |= *reinterpret_cast<const uint64_t*>(stream) << (64 - static_cast<uint8_t>(bitPosition));
+        stream += bitPosition >> 3;
+        bitPosition = bitPosition & 7;
+
+        int64_t index = bits & 0x3F;
+        uint8_t opcode = m_patchTables.Opcodes[index];
+        uint8_t opcodeBits = m_patchTables.OpcodeBits[index];
+        bits >>= opcodeBits;
+        bitPosition += opcodeBits;
+        numOpcodes++;
+
+        if (opcode >= kNumPatchOpcodes)
+        {
+            throw std::runtime_error("Patch opcode invalid");
+        }
+
+        if (opcode > 3)
+        {
+            // Opcodes 4 and 5 replace one byte and 6 replaces two, then each reads a fixed number of bytes
+            uint64_t replace = opcode == 6 ? 2 : 1;
+            uint64_t read = kSpecialPatchAmounts[opcode - 4];
+            AddPatchCommand(kPatchCommandReplace, replace, dataOffset);
+            AddPatchCommand(kPatchCommandRead, read, 0);
+            dataOffset += replace;
+            bytesOutput += replace + read;
+        }
+        else
+        {
+            uint8_t lengthBits = m_patchTables.LengthBits[static_cast<uint8_t>(bits)];
+            uint8_t prefixBits = m_patchTables.LengthPrefixBits[static_cast<uint8_t>(bits)];
+            uint64_t lengthValue = bits >> prefixBits;
+            bits = lengthValue >> lengthBits;
+            bitPosition += lengthBits + prefixBits;
+            uint64_t length = (1ULL << lengthBits) + (lengthValue & ((1ULL << lengthBits) - 1));
+
+            AddPatchCommand(opcode, length, dataOffset);
+            if (opcode == kPatchCommandInsert || opcode == kPatchCommandReplace)
+            {
+                dataOffset += length;
+            }
 
-    int64_t index = m_patch696 & 0x3F;
-    uint8_t opcode = m_patchData1[index];
-    uint8_t patchData2Val = m_patchData2[index];
+            if (opcode != kPatchCommandSkip)
+            {
+                bytesOutput += length;
+            }
+        }
+    }
 
-    m_patch696 >>= patchData2Val;
-    m_patch704 += patchData2Val;
+    m_logger->debug("Decoded {} patch opcodes into {} patch commands", numOpcodes, m_patchCommands.size());
+}
 
-    if (opcode >= kNumPatchFunctions)
+void RPakFile::AddPatchCommand(uint8_t type, uint64_t length, uint64_t dataOffset)
+{
+    // Patch data is used in order, so back to back commands of the same type can always be merged. The
+    // read of the base file is kept on its own, since that data is new in this patch and the rest isn't.
+    if (m_patchCommands.size() > 1 && m_patchCommands.back().Type == type)
     {
-        throw std::runtime_error("Patch opcode invalid");
+        m_patchCommands.back().Length += length;
+        return;
     }
 
-    m_patchInstruction = RPakFile::PatchFunctions[opcode];
+    m_patchCommands.push_back({ type, length, type == kPatchCommandInsert || type == kPatchCommandReplace ? dataOffset : 0 });
+}
+
+void RPakFile::MarkChanged(uint64_t offset, uint64_t size)
+{
+    // offset is relative to the start of the read, which is always a whole section
+    if (m_loadingSection < 0 || m_outerHeader.NumRPakLinks == 0)
+    {
+        return;
+    }
 
-    if (opcode > 3)
+    auto& ranges = m_changedRanges[m_loadingSection];
+    if (!ranges.empty() && ranges.back().second == offset)
     {
-        m_bytesUntilNextPatch = kSpecialPatchAmounts[opcode - 4];
+        ranges.back().second += size;
     }
     else
     {
-        uint8_t patchData3Val = m_patchData3[static_cast<uint8_t>(m_patch696)];
-        uint8_t patchData4Val = m_patchData4[static_cast<uint8_t>(m_patch696)];
-        uint64_t new696Val = m_patch696 >> patchData4Val;
-        m_patch696 = new696Val >> patchData3Val;
-        m_bytesUntilNextPatch = (1ULL << patchData3Val) + (new696Val & ((1ULL << patchData3Val) - 1));
-        m_patch704 += patchData3Val + patchData4Val;
+        ranges.emplace_back(offset, offset + size);
     }
 }
 
-bool RPakFile::IsReferenceValid(SectionReference& ref)
+void RPakFile::BuildChangeIndex()
 {
-    if (ref.Section >= m_outerHeader.NumSections)
+    // Only the size of an asset's metadata is stored. Anything else is taken to run up to where the next asset's
+    // metadata or data starts in the same section, which can overstate how big it is but never understate it.
+    // Starts of things pointed to aren't used, since a pointer can just as well be into the middle of an object.
+    m_objectStarts.resize(m_outerHeader.NumSections);
+    for (uint32_t i = 0; i < m_outerHeader.NumAssets; i++)
     {
-        return false;
+        AssetDefinition& asset = m_assetDefinitions[i];
+        if (IsReferenceValid(asset.MetadataRef))
+        {
+            m_objectStarts[asset.MetadataRef.Section].push_back(asset.MetadataRef.Offset);
+        }
+        if (IsReferenceValid(asset.DataRef))
+        {
+            m_objectStarts[asset.DataRef.Section].push_back(asset.DataRef.Offset);
+        }
     }
 
-    if (ref.Offset >= m_sectionDescriptors[ref.Section].Size)
+    m_relocationsByLocation.resize(m_outerHeader.NumRelocations);
+    std::iota(m_relocationsByLocation.begin(), m_relocationsByLocation.end(), 0);
+
+    for (auto& starts : m_objectStarts)
     {
-        return false;
+        std::sort(starts.begin(), starts.end());
+        starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
     }
 
-    return true;
-}
-
-// All these functions assume that bytesToRead > 0
-
-size_t RPakFile::PatchFuncRead(char* buffer, size_t bytesToRead)
-{
-    // Just read data from the input
-    size_t read = std::min(bytesToRead, m_bytesUntilNextPatch);
-    m_logger->trace("Reading 0x{:x} bytes (wanted to read 0x{:x}) - m_bytesUntilNextPatch = 0x{:x}", read, bytesToRead, m_bytesUntilNextPatch);
-    m_reader.ReadData(buffer, read);
-    m_bytesUntilNextPatch -= read;
-    // TODO: Write to debug output file and log current output position
-    return read;
-}
-
-size_t RPakFile::PatchFuncSkip(char* buffer, size_t bytesToRead)
-{
-    // Advance the internal pointer by as much as possible, but don't read anything
-    size_t skip = m_bytesUntilNextPatch;
-    m_logger->trace("Skipping 0x{:x} bytes - m_bytesUntilNextPatch = 0x{:x}", skip, m_bytesUntilNextPatch);
-    m_reader.ReadData(buffer, 0, skip);
-    m_bytesUntilNextPatch -= skip;
-    return 0;
-}
-
-size_t RPakFile::PatchFuncInsert(char* buffer, size_t bytesToRead)
-{
-    // For an insert, the input data stream doesn't progress - only the output
-    size_t insert = std::min(bytesToRead, m_bytesUntilNextPatch);
-    m_logger->trace("Inserting 0x{:x} bytes - m_bytesUntilNextPatch = 0x{:x}", insert, m_bytesUntilNextPatch);
-    memcpy(buffer, m_currentPatchData, insert);
-    m_currentPatchData += insert;
-    m_bytesUntilNextPatch -= insert;
-    // TODO: Write to debug output file and log current output position
-    return insert;
+    std::sort(m_relocationsByLocation.begin(), m_relocationsByLocation.end(), [this](uint32_t a, uint32_t b) {
+        const SectionReference& locA = m_relocationDescriptors[a];
+        const SectionReference& locB = m_relocationDescriptors[b];
+        return locA.Section < locB.Section || (locA.Section == locB.Section && locA.Offset < locB.Offset);
+    });
 }
 
-size_t RPakFile::PatchFuncReplace(char* buffer, size_t bytesToRead)
+bool RPakFile::IsRangeChanged(uint32_t section, uint64_t start, uint64_t end)
 {
-    // For a replace, the input data also progresses
-    size_t replace = std::min(bytesToRead, m_bytesUntilNextPatch);
-    m_logger->trace("Replacing 0x{:x} bytes - m_bytesUntilNextPatch = 0x{:x}", replace, m_bytesUntilNextPatch);
-    memcpy(buffer, m_currentPatchData, replace);
-    m_reader.ReadData(buffer, 0, replace);
-    m_currentPatchData += replace;
-    m_bytesUntilNextPatch -= replace;
-    // TODO: Write to debug output file and log current output position
-    return replace;
+    // Find the first changed range that ends after the start, and see if it begins before the end
+    const auto& ranges = m_changedRanges[section];
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), start, [](uint64_t pos, const std::pair<uint64_t, uint64_t>& range) {
+        return pos < range.second;
+    });
+    return it != ranges.end() && it->first < end;
 }
 
-size_t RPakFile::PatchFuncReplaceOneThenRead(char* buffer, size_t bytesToRead)
+uint64_t RPakFile::GetObjectEnd(uint32_t section, uint64_t offset)
 {
-    m_logger->trace("Replacing 1 byte then reading - m_bytesUntilNextPatch = 0x{:x}", m_bytesUntilNextPatch);
-    buffer[0] = m_currentPatchData[0];
-    m_reader.ReadData(buffer, 0, 1);
-    m_currentPatchData++;
-    m_patchInstruction = &RPakFile::PatchFuncRead;
-    // TODO: Write to debug output file and log current output position
-    return 1 + (bytesToRead > 1 ? PatchFuncRead(buffer + 1, bytesToRead - 1) : 0);
+    const auto& starts = m_objectStarts[section];
+    auto it = std::upper_bound(starts.begin(), starts.end(), offset);
+    return it != starts.end() ? *it : m_sectionDescriptors[section].Size;
 }
 
-size_t RPakFile::PatchFuncReplaceTwoThenRead(char* buffer, size_t bytesToRead)
+bool RPakFile::IsReferenceValid(SectionReference& ref)
 {
-    // If we can write both bytes, do that then execute the read
-    // Otherwise, if we can only write 1, do that then switch to ReplaceOneThenRead
-    m_logger->trace("Replacing 2 bytes then reading - m_bytesUntilNextPatch = 0x{:x}", m_bytesUntilNextPatch);
-
-    size_t replace = std::min(bytesToRead, 2ULL);
-    memcpy(buffer, m_currentPatchData, replace);
-    m_reader.ReadData(buffer, 0, replace);
-    m_currentPatchData += replace;
-
-    // TODO: Write to debug output file and log current output position
-
-    if (bytesToRead >= 2)
-    {
-        m_patchInstruction = &RPakFile::PatchFuncRead;
-        return 2 + (bytesToRead > 2 ? PatchFuncRead(buffer + 2, bytesToRead - 2) : 0);
-    }
-    else if (bytesToRead == 1)
+    if (ref.Section >= m_outerHeader.NumSections)
     {
-        m_patchInstruction = &RPakFile::PatchFuncReplaceOneThenRead;
-        return 1;
+        return false;
     }
-    else
+
+    if (ref.Offset >= m_sectionDescriptors[ref.Section].Size)
     {
-        throw std::runtime_error("Unexpected value for bytesToRead");
+        return false;
     }
+
+    return true;
 }
@@ -1,48 +1,120 @@
 #pragma once
 
 const size_t kNumSlots = 4;
-const size_t kNumPatchFunctions = 7;
+const size_t kNumPatchOpcodes = 7;
+
+// Patch commands, which are what the patch opcodes are decoded into
+const uint8_t kPatchCommandRead = 0; // Copy bytes from the input
+const uint8_t kPatchCommandSkip = 1; // Skip bytes of the input without outputting anything
+const uint8_t kPatchCommandInsert = 2; // Output bytes from the patch data
+const uint8_t kPatchCommandReplace = 3; // Output bytes from the patch data in place of the same number of input bytes
+
+struct PatchCommand
+{
+    uint8_t Type;
+    uint64_t Length;
+    uint64_t DataOffset; // Offset into the patch data block for inserts and replaces
+};
 
 typedef std::function<std::unique_ptr<IDecompressedFileReader>(const std::string&, int)> tRpakOpenerFunc;
 
+enum class RPakLoadMode
+{
+    Full,
+    MetadataOnly, // Sections only used for asset data are skipped, so assets have no data and pointers into those sections are null
+    OnDemand, // Only the header is read up front. Sections are read by GetAsset, along with everything they point to.
+};
+
+// Seconds spent in each stage of RPakFile::Load
+struct RPakLoadTimings
+{
+    double ReadHeader = 0;
+    double LoadSections = 0;
+    double ApplyRelocations = 0;
+};
+
 class RPakFile
 {
 public:
     RPakFile(std::string name, int pakNumber, tRpakOpenerFunc rpakOpener);
     ~RPakFile();
-    void Load();
+    void Load(RPakLoadMode mode = RPakLoadMode::Full);
+    void Flatten(const std::string& outputFile); // Applies the patch chain and writes the result as one standalone RPak
+    void SetArenaOptions(const SlotArenaOptions& options);
+    void UseSnapshots(const std::string& snapshotDir); // Full loads come from a snapshot in snapshotDir when there is a current one, and save one when there isn't
     uint32_t GetNumAssets();
     const AssetDefinition* GetAssetDefinition(uint32_t index);
     std::unique_ptr<IAsset> GetAsset(uint32_t index);
+    std::optional<uint32_t> FindAsset(uint64_t hash) const; // Index of the asset with the given hash
+    bool IsAssetChanged(uint32_t index); // Whether the latest patch may have changed the asset, compared to the version of the pak it patches. Not available when loading on demand or from a snapshot.
+    std::vector<int> GetLinkedRPakNumbers() const;
     const std::vector<std::string>& GetStarpakPaths() const;
+    const RPakLoadTimings& GetLoadTimings() const;
 #ifdef APEX
     const std::vector<std::string>& GetFullStarpakPaths() const;
 #endif
 
 private:
+    // A snapshot is this header, then the linked pak sizes and numbers, starpak blocks, slot descriptors, section descriptors, the
+    // offset of each section in the file, relocation descriptors, asset definitions and the extra header. The slot data comes after
+    // that, with every relocated pointer stored as an offset into the file.
+    struct SnapshotHeader
+    {
+        uint32_t Signature;
+        uint32_t Version;
+        OuterHeader PakHeader; // Header of the latest pak the snapshot was made from
+        int32_t PakNumber;
+        uint32_t Unused;
+        uint64_t SlotOffsets[kNumSlots];
+        uint64_t SlotSizes[kNumSlots];
+    };
+
+    // Open addressing hash table from asset hash to index, with linear probing
+    struct AssetIndexEntry
+    {
+        uint64_t Hash;
+        uint32_t Index; // kNoAssetIndex for empty entries
+    };
+
+    void ReadOuterHeader();
     void ReadHeader();
     void LoadSections();
     void ApplyRelocations();
+    std::vector<bool> FindMetadataSections();
+    void PushLinkedRPaks();
+    void LoadSkippedSections(std::vector<bool>& sectionNeeded, const std::vector<std::vector<uint32_t>>& sectionRelocations, uint64_t sectionDataStart);
+    void SetSectionStreamOffsets(uint64_t sectionDataStart);
+    void PrepareOnDemandSections();
+    void LoadSectionsOnDemand(std::vector<uint32_t> sections);
+    void ReadSectionFromStream(uint32_t section);
+    void RewindPatchedData();
+    char* AllocateSection(uint32_t section);
+    uint32_t ApplyRelocation(uint32_t index); // Returns the section the relocation points to
+    void WriteStarpakBlock(std::ofstream& output, const std::vector<std::string>& paths, size_t blockSize);
+    std::filesystem::path GetSnapshotPath();
+    bool LoadSnapshot();
+    void SaveSnapshot();
+    void CloseSnapshot();
+    uint64_t GetSnapshotOffset(const char* pointer, const SnapshotHeader& header);
 
     std::vector<std::string> ParseStarpakBlock(const char* data, size_t blockSize);
+    size_t GetExtraHeaderSize() const;
     void ReadPatchedData(char* buffer, size_t bytesToRead);
     int32_t NormalizeSection(uint32_t section);
-    void UpdatePatchInstruction();
+    void DecodePatchCommands(const uint8_t* patchStream, uint64_t dataOffset, uint64_t outputSize);
+    void AddPatchCommand(uint8_t type, uint64_t length, uint64_t dataOffset);
+    void MarkChanged(uint64_t offset, uint64_t size);
+    void BuildChangeIndex();
+    bool IsRangeChanged(uint32_t section, uint64_t start, uint64_t end);
+    uint64_t GetObjectEnd(uint32_t section, uint64_t offset);
     bool IsReferenceValid(SectionReference& ref);
-
-    // Patch functions
-    size_t PatchFuncRead(char* buffer, size_t bytesToRead);
-    size_t PatchFuncSkip(char* buffer, size_t bytesToRead);
-    size_t PatchFuncInsert(char* buffer, size_t bytesToRead);
-    size_t PatchFuncReplace(char* buffer, size_t bytesToRead);
-    size_t PatchFuncReplaceOneThenRead(char* buffer, size_t bytesToRead);
-    size_t PatchFuncReplaceTwoThenRead(char* buffer, size_t bytesToRead);
-
-    static size_t(RPakFile::*PatchFunctions[kNumPatchFunctions])(char* buffer, size_t bytesToRead);
+    void BuildAssetIndex();
+    size_t GetAssetIndexBucket(uint64_t hash) const;
 
     std::shared_ptr<spdlog::logger> m_logger;
     ChainedReader m_reader;
     std::string m_name;
+    int m_pakNumber;
     tRpakOpenerFunc m_rpakOpener;
 
     OuterHeader m_outerHeader;
@@ -51,16 +123,10 @@ private:
     uint32_t m_patchDataBlockSize;
     uint32_t m_startingSectionOffset;
     std::unique_ptr<uint8_t[]> m_patchDataBlock;
-    uint8_t m_patchData1[64];
-    uint8_t m_patchData2[64];
-    uint8_t m_patchData3[256];
-    uint8_t m_patchData4[256];
-    uint64_t* m_patch680;
-    uint64_t m_patch696;
-    uint32_t m_patch704;
-    uint64_t m_bytesUntilNextPatch;
-    uint8_t* m_currentPatchData;
-    size_t(RPakFile::*m_patchInstruction)(char* buffer, size_t bytesToRead);
+    rtech::PatchTables m_patchTables;
+    std::vector<PatchCommand> m_patchCommands;
+    size_t m_currentPatchCommand;
+    uint64_t m_patchCommandOffset; // Bytes of the current command that have already been carried out
 
     // RPak links
     std::unique_ptr<LinkedRPakSize[]> m_linkedRPakSizes;
@@ -74,18 +140,46 @@ private:
 
     // Slots
     std::unique_ptr<SlotDescriptor[]> m_slotDescriptors;
-    char* m_slotData[kNumSlots] = {}; // TODO: Make this a unique_ptr. No idea why it's so hard to do it.
+    SlotArena m_slotArena;
+    SlotArenaOptions m_arenaOptions;
+    char* m_slotData[kNumSlots] = {}; // Points into m_slotArena. Only set for full loads, which commit all of the arena up front.
+    uint64_t m_slotSizes[kNumSlots] = {};
 
     // Sections
     std::unique_ptr<SectionDescriptor[]> m_sectionDescriptors;
     std::unique_ptr<char*[]> m_sectionPointers; // TODO: This is not really safe because it contains pointers into the allocated memory in m_slotData
+    std::vector<uint64_t> m_sectionArenaOffsets; // When not doing a full load, sections are committed at these offsets in m_slotArena as they are read
+    RPakLoadMode m_loadMode;
+
+    // Loading sections on demand
+    uint64_t m_patchedPosition; // Bytes of patched data read so far, not counting the outer header
+    std::vector<uint64_t> m_sectionStreamOffsets; // Where each section starts in the patched data
+    std::vector<bool> m_sectionLoaded;
+    std::vector<std::vector<uint32_t>> m_sectionRelocations; // Relocations located in each section
 
     // Relocations
     std::unique_ptr<SectionReference[]> m_relocationDescriptors;
+    std::unique_ptr<SectionReference[]> m_relocationTargets; // What each relocation pointed at before it was applied
 
     // Assets
     std::unique_ptr<AssetDefinition[]> m_assetDefinitions;
+    std::vector<AssetIndexEntry> m_assetIndex;
+    uint32_t m_assetIndexShift;
 
     // Extra header
     std::unique_ptr<char[]> m_extraHeader;
+
+    RPakLoadTimings m_loadTimings;
+
+    // Snapshot the pak was loaded from, mapped copy-on-write so relocations can be rebased in place
+    std::string m_snapshotDir;
+    HANDLE m_snapshotFile;
+    HANDLE m_snapshotMapping;
+    char* m_snapshotView;
+
+    // Output that came from the latest patch rather than from the paks it links to
+    int32_t m_loadingSection;
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> m_changedRanges; // Sorted [start, end) ranges for each section
+    std::vector<std::vector<uint64_t>> m_objectStarts; // Sorted offsets of asset metadata and data, for each section
+    std::vector<uint32_t> m_relocationsByLocation;
 };
@@ -1,10 +1,13 @@
 #include "pch.h"
 
 namespace rtech {
+const char kPatchOpcodeSymbols[] = { 0, 1, 2, 3, 4, 5, 6 };
+const char kPatchLengthSymbols[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
+
 uint64_t(*AlignedHashFunc)(const char* data);
 uint64_t(*UnalignedHashFunc)(const char* data);
-uint64_t(*SetupDecompressState)(void* pState, char* compressedData, int64_t alwaysFFFFFF, int64_t totalFileSize, int64_t startVirtualOffset, int64_t headerSize);
-void(*DoDecompress)(void* pState, uint64_t totalBytesReadAndAcked, uint64_t someVal);
+uint64_t(*SetupDecompressState)(DecompressState* pState, char* compressedData, int64_t alwaysFFFFFF, int64_t totalFileSize, int64_t startVirtualOffset, int64_t headerSize);
+void(*DoDecompress)(DecompressState* pState, uint64_t totalBytesReadAndAcked, uint64_t someVal);
 int64_t(*ConstructPatchArray)(uint8_t* inputArray, int32_t a2, const char* a3, uint8_t* a4, uint8_t* a5);
 
 void Initialize(const std::string& dllPath)
@@ -61,4 +64,13 @@ uint32_t HalfHashData(const char* data)
     return static_cast<uint32_t>(hash ^ (hash >> 32));
 }
 
+// The opcode table comes first in the block, then the length table straight after it
+size_t BuildPatchTables(const uint8_t* patchDataBlock, PatchTables* tables)
+{
+    uint8_t* block = const_cast<uint8_t*>(patchDataBlock);
+    size_t size = ConstructPatchArray(block, 6, kPatchOpcodeSymbols, tables->Opcodes, tables->OpcodeBits);
+    size += ConstructPatchArray(block + size, 8, kPatchLengthSymbols, tables->LengthBits, tables->LengthPrefixBits);
+    return size;
+}
+
 }
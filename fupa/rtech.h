@@ -2,11 +2,51 @@
 
 namespace rtech {
 
+// Layout of the state block used by the decompressor in rtech_game.dll. The input and output
+// buffers are both ring buffers - InputMask and OutputMask are applied to positions to get the
+// offset into each buffer.
+struct DecompressState
+{
+    uint64_t InputBuffer;
+    uint64_t OutputBuffer;
+    uint64_t InputMask;
+    uint64_t OutputMask;
+    uint64_t TotalFileSize;
+    uint64_t DecompressedSize;
+    uint64_t InputWindowMask;
+    uint64_t OutputWindowMask;
+    uint32_t HeaderSkipBytes;
+    uint32_t Unknown1;
+    uint64_t InputPosition; // Total compressed bytes consumed
+    uint64_t OutputPosition; // Total decompressed bytes produced (including the header)
+    uint64_t InputBytesNeeded;
+    uint64_t CurrentBits;
+    uint32_t CurrentBitOffset;
+    uint32_t Unknown2;
+    uint64_t Unknown3;
+    uint64_t CompressedStreamSize;
+    uint64_t DecompressedStreamSize;
+};
+
+static_assert(sizeof(DecompressState) == 0x88, "DecompressState must be 0x88 bytes");
+
+// Lookup tables for decoding the patch opcode stream, built from the start of a pak's patch data block.
+// Opcodes and OpcodeBits are indexed by the next 6 bits of the stream, LengthBits and LengthPrefixBits
+// by the next 8 bits once an opcode that takes a length has been read.
+struct PatchTables
+{
+    uint8_t Opcodes[64];
+    uint8_t OpcodeBits[64]; // Number of bits the opcode took up
+    uint8_t LengthBits[256]; // Number of bits holding the length, not counting the implicit top bit
+    uint8_t LengthPrefixBits[256]; // Number of bits before the length
+};
+
 void Initialize(const std::string& dllPath);
 uint64_t HashData(const char* data);
 uint32_t HalfHashData(const char* data);
-extern uint64_t(*SetupDecompressState)(void* pState, char* compressedData, int64_t alwaysFFFFFF, int64_t totalFileSize, int64_t startVirtualOffset, int64_t headerSize);
-extern void(*DoDecompress)(void* pState, uint64_t totalBytesReadAndAcked, uint64_t someVal);
+size_t BuildPatchTables(const uint8_t* patchDataBlock, PatchTables* tables); // Returns the number of bytes the tables took up in the block
+extern uint64_t(*SetupDecompressState)(DecompressState* pState, char* compressedData, int64_t alwaysFFFFFF, int64_t totalFileSize, int64_t startVirtualOffset, int64_t headerSize);
+extern void(*DoDecompress)(DecompressState* pState, uint64_t totalBytesReadAndAcked, uint64_t someVal);
 extern int64_t(*ConstructPatchArray)(uint8_t* inputArray, int32_t a2, const char* a3, uint8_t* a4, uint8_t* a5);
 
 }
@@ -58,4 +58,57 @@ bool EndsWith(const std::string& value, const std::string& ending)
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+// Matches value against a pattern where * matches any run of characters and ? matches
+// any single character. Comparison is case-insensitive, like file names on Windows.
+bool WildcardMatch(const std::string& value, const std::string& pattern)
+{
+    size_t v = 0;
+    size_t p = 0;
+    size_t starPattern = std::string::npos;
+    size_t starValue = 0;
+    while (v < value.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || tolower(static_cast<unsigned char>(pattern[p])) == tolower(static_cast<unsigned char>(value[v]))))
+        {
+            v++;
+            p++;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            starPattern = p++;
+            starValue = v;
+        }
+        else if (starPattern != std::string::npos)
+        {
+            p = starPattern + 1;
+            v = ++starValue;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*')
+    {
+        p++;
+    }
+
+    return p == pattern.size();
+}
+
+// 64-bit FNV-1a. Stable across builds and platforms, so it can be used for names of files on disk.
+// Pass the result of a previous call as hash to continue hashing more data.
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
 }